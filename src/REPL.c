@@ -1,12 +1,13 @@
-#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "core/core.h"
 #include "env.h"
+#include "gc.h"
 #include "interpreter.h"
 #include "tokens.h"
+#include "unit.h"
 
 #define PROMPT "[vispel] >> "
 
@@ -17,43 +18,87 @@ prompt()
         fflush(stdout);
 }
 
+void
+usage(char *name)
+{
+        report("Usage: %s [--vm | --closure | --emit-c] [--no-jit] [--gc-stats] [--opt-stats] [--lex-bench] [file]\n", name);
+}
+
 int
 main(int argc, char **argv)
 {
         char buf[1024 * 1024];
-        ssize_t n;
-        int fd;
-        int interactive = 0;
-
-        if (argc == 2)
-                fd = open(argv[1], O_RDONLY);
-        else {
-                fd = STDIN_FILENO;
-                interactive = 1;
+        ssize_t n = 0;
+        char *filename = NULL;
+        int lex_only = 0;
+        void (*run)() = eval;
+
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--vm"))
+                        run = vm_eval;
+                else if (!strcmp(argv[i], "--closure"))
+                        run = cnode_eval;
+                else if (!strcmp(argv[i], "--emit-c"))
+                        run = emitc_eval;
+                else if (!strcmp(argv[i], "--gc-stats"))
+                        gc_stats = 1;
+                else if (!strcmp(argv[i], "--opt-stats"))
+                        opt_stats = 1;
+                else if (!strcmp(argv[i], "--no-jit"))
+                        jit_enabled = 0;
+                else if (!strcmp(argv[i], "--lex-bench"))
+                        lex_only = 1;
+                else if (argv[i][0] == '-' || filename) {
+                        usage(argv[0]);
+                        return -1;
+                } else
+                        filename = argv[i];
         }
 
-        if (fd < 0) {
-                report("Can not open to read file `%s`\n", argv[1]);
-                return -1;
+        if (lex_only) {
+                if (!filename || lex_bench(filename) < 0) {
+                        usage(argv[0]);
+                        return -1;
+                }
+                unit_free_all();
+                return 0;
         }
 
-        env_create();
+        env_create(0);
         load_core_lib();
-        if (interactive) prompt();
-        while ((n = read(fd, buf, sizeof buf - 2)) > 0) {
-                buf[n] = 0;
-                buf[n + 1] = EOF;
-                lex_analize(buf);
-                // print_tokens();
-                tok_parse();
-                // print_ast();
-                if (resolve() == 0) eval();
-                if (interactive) prompt();
+
+        /* A file is lexed and run at once. The REPL lexes and runs each
+         * chunk it reads */
+        if (filename) {
+                if ((n = lex_file(filename)) < 0) {
+                        report("Can not open to read file `%s`\n", filename);
+                        env_destroy();
+                        unit_free_all();
+                        return -1;
+                }
+                if (n > 0) {
+                        tok_parse();
+                        if (resolve() == 0) run();
+                }
+        } else {
+                prompt();
+                while ((n = read(STDIN_FILENO, buf, sizeof buf - LEX_PAD)) > 0) {
+                        buf[n] = 0;
+                        buf[n + 1] = EOF;
+                        unit_begin();
+                        lex_analize(buf);
+                        // print_tokens();
+                        tok_parse();
+                        // print_ast();
+                        if (resolve() == 0) run();
+                        prompt();
+                }
         }
         env_destroy();
-        free_tokens();
-        free_stmt_head();
-        
+        if (gc_stats) gc_print_stats();
+        if (opt_stats) optimize_print_stats();
+        unit_free_all();
+
         if (n < 0) {
                 report("Can not read\n");
                 return -1;
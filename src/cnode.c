@@ -0,0 +1,527 @@
+/* VISPEL interpreter - Closure compiled evaluation
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cnode.h"
+#include "env.h"
+#include "interpreter.h"
+#include "str.h"
+#include "tokens.h"
+#include "unit.h"
+
+static Value ret_val;
+
+static inline _Noreturn void
+runtime_error()
+{
+        longjmp(eval_runtime_error, 1);
+}
+
+#define EVAL(e) ((e)->fn(e))
+#define EXEC(s) ((s)->fn(s))
+#define NUM(n) ((Value) { .type = TYPE_NUM, .num = (n) })
+
+static Value
+cn_const(CExpr *e)
+{
+        return e->lit;
+}
+
+static Value
+cn_local(CExpr *e)
+{
+        return lower_env->slots[e->var.slot];
+}
+
+static Value
+cn_upvar(CExpr *e)
+{
+        return *env_ref(e->var.depth, e->var.slot);
+}
+
+static Value
+cn_global(CExpr *e)
+{
+        return global_env->slots[e->var.slot];
+}
+
+static Value
+cn_assign_local(CExpr *e)
+{
+        Value v = EVAL(e->assign.value);
+        return lower_env->slots[e->assign.slot] = v;
+}
+
+static Value
+cn_assign(CExpr *e)
+{
+        Value v = EVAL(e->assign.value);
+        return *env_ref(e->assign.depth, e->assign.slot) = v;
+}
+
+static Value
+cn_assign_global(CExpr *e)
+{
+        Value v = EVAL(e->assign.value);
+        return global_env->slots[e->assign.slot] = v;
+}
+
+/* One handler per operator, and another one for a constant number as
+ * right operand. Only int-int is done here, anything else is left to
+ * eval_binop() */
+#define CN_BINOP(NAME, OP, TOK)                                        \
+        static Value NAME(CExpr *e)                                    \
+        {                                                              \
+                Value lhs = EVAL(e->bin.lhs);                          \
+                Value rhs = EVAL(e->bin.rhs);                          \
+                if (lhs.type == TYPE_NUM && rhs.type == TYPE_NUM)      \
+                        return NUM(lhs.num OP rhs.num);                \
+                return eval_binop(TOK, lhs, rhs);                      \
+        }                                                              \
+        static Value NAME##_k(CExpr *e)                                \
+        {                                                              \
+                Value lhs = EVAL(e->bink.lhs);                         \
+                if (lhs.type == TYPE_NUM)                              \
+                        return NUM(lhs.num OP e->bink.k.num);          \
+                return eval_binop(TOK, lhs, e->bink.k);                \
+        }
+
+CN_BINOP(cn_add, +, PLUS)
+CN_BINOP(cn_sub, -, MINUS)
+CN_BINOP(cn_mul, *, STAR)
+CN_BINOP(cn_div, /, SLASH)
+CN_BINOP(cn_band, &, BITWISE_AND)
+CN_BINOP(cn_bor, |, BITWISE_OR)
+CN_BINOP(cn_bxor, ^, BITWISE_XOR)
+CN_BINOP(cn_shl, <<, SHIFT_LEFT)
+CN_BINOP(cn_shr, >>, SHIFT_RIGHT)
+CN_BINOP(cn_eq, ==, EQUAL_EQUAL)
+CN_BINOP(cn_ne, !=, BANG_EQUAL)
+CN_BINOP(cn_gt, >, GREATER)
+CN_BINOP(cn_ge, >=, GREATER_EQUAL)
+CN_BINOP(cn_lt, <, LESS)
+CN_BINOP(cn_le, <=, LESS_EQUAL)
+
+#undef CN_BINOP
+
+static const struct {
+        CExprFn fn;
+        CExprFn fn_k;
+} binop_table[] = {
+        [PLUS] = { cn_add, cn_add_k },
+        [MINUS] = { cn_sub, cn_sub_k },
+        [STAR] = { cn_mul, cn_mul_k },
+        [SLASH] = { cn_div, cn_div_k },
+        [BITWISE_AND] = { cn_band, cn_band_k },
+        [BITWISE_OR] = { cn_bor, cn_bor_k },
+        [BITWISE_XOR] = { cn_bxor, cn_bxor_k },
+        [SHIFT_LEFT] = { cn_shl, cn_shl_k },
+        [SHIFT_RIGHT] = { cn_shr, cn_shr_k },
+        [EQUAL_EQUAL] = { cn_eq, cn_eq_k },
+        [BANG_EQUAL] = { cn_ne, cn_ne_k },
+        [GREATER] = { cn_gt, cn_gt_k },
+        [GREATER_EQUAL] = { cn_ge, cn_ge_k },
+        [LESS] = { cn_lt, cn_lt_k },
+        [LESS_EQUAL] = { cn_le, cn_le_k },
+        [UNKNOWN] = { NULL, NULL },
+};
+
+static Value
+cn_not(CExpr *e)
+{
+        return NUM(!is_true(EVAL(e->un.rhs)));
+}
+
+static Value
+cn_neg(CExpr *e)
+{
+        Value v = EVAL(e->un.rhs);
+        if (v.type == TYPE_NUM) return NUM(-v.num);
+        return eval_unop(MINUS, v);
+}
+
+static Value
+cn_bnot(CExpr *e)
+{
+        Value v = EVAL(e->un.rhs);
+        if (v.type == TYPE_NUM) return NUM(~v.num);
+        return eval_unop(BITWISE_NOT, v);
+}
+
+static Value
+cn_or(CExpr *e)
+{
+        Value v;
+        v = EVAL(e->bin.lhs);
+        if (is_true(v)) return v;
+        v = EVAL(e->bin.rhs);
+        if (is_true(v)) return v;
+        return NUM(0);
+}
+
+static Value
+cn_and(CExpr *e)
+{
+        return NUM(is_true(EVAL(e->bin.lhs)) && is_true(EVAL(e->bin.rhs)));
+}
+
+static Value
+cn_call(CExpr *e)
+{
+        Value func = EVAL(e->call.callee);
+        Value argv[e->call.argc + 1];
+        Value ret = NO_VALUE;
+        Env *prev;
+
+        switch (func.type) {
+        case TYPE_CALLABLE:
+        case TYPE_CORE_CALL:
+                break;
+        default:
+                report("Calling a non callable expression\n");
+                runtime_error();
+        }
+        check_arity(func, e->call.argc);
+
+        for (int i = 0; i < e->call.argc; i++)
+                argv[i] = EVAL(e->call.args[i]);
+
+        if (func.type == TYPE_CORE_CALL)
+                return func.fn->ifunc(argv, e->call.argc);
+
+        prev = env_push_call(func.fn, argv, e->call.argc);
+        if (EXEC(func.fn->cbody) == EXEC_RETURN) ret = ret_val;
+        env_destroy_e(prev);
+        return ret;
+}
+
+static Exec
+cs_expr(CStmt *s)
+{
+        EVAL(s->expr.value);
+        return EXEC_NEXT;
+}
+
+static Exec
+cs_vardecl(CStmt *s)
+{
+        Value v = EVAL(s->vardecl.value);
+        *env_decl_ref(s->vardecl.slot) = v;
+        return EXEC_NEXT;
+}
+
+static Exec
+cs_funcdecl(CStmt *s)
+{
+        Value v = new_closure(s->funcdecl.arity, s->funcdecl.name,
+                              s->funcdecl.captures);
+        v.fn->cbody = s->funcdecl.body;
+        *env_decl_ref(s->funcdecl.slot) = v;
+        return EXEC_NEXT;
+}
+
+static Exec
+cs_assert(CStmt *s)
+{
+        if (!is_true(EVAL(s->expr.value))) {
+                report("Assert failed\n");
+                runtime_error();
+        }
+        return EXEC_NEXT;
+}
+
+static Exec
+cs_block(CStmt *s)
+{
+        Exec ex = EXEC_NEXT;
+        env_push(s->block.size);
+        for (int i = 0; i < s->block.count && ex == EXEC_NEXT; i++)
+                ex = EXEC(s->block.body[i]);
+        env_destroy();
+        return ex;
+}
+
+static Exec
+cs_if(CStmt *s)
+{
+        if (is_true(EVAL(s->ifstmt.cond))) return EXEC(s->ifstmt.body);
+        if (s->ifstmt.elsebody) return EXEC(s->ifstmt.elsebody);
+        return EXEC_NEXT;
+}
+
+static Exec
+cs_while(CStmt *s)
+{
+        Exec ex = EXEC_NEXT;
+        while (ex == EXEC_NEXT && is_true(EVAL(s->whilestmt.cond)))
+                ex = EXEC(s->whilestmt.body);
+        return ex;
+}
+
+static Exec
+cs_return(CStmt *s)
+{
+        ret_val = EVAL(s->expr.value);
+        return EXEC_RETURN;
+}
+
+static CExpr *
+new_cexpr(CExprFn fn)
+{
+        CExpr *e = unit_alloc(sizeof(CExpr));
+        e->fn = fn;
+        return e;
+}
+
+static CStmt *
+new_cstmt(CStmtFn fn)
+{
+        CStmt *s = unit_alloc(sizeof(CStmt));
+        s->fn = fn;
+        return s;
+}
+
+static CExpr *cnode_expr(Expr *e);
+
+static CExpr *
+cnode_litexpr(Expr *e)
+{
+        CExpr *c;
+
+        if (e->litexpr.token == IDENTIFIER) {
+                if (e->litexpr.depth == GLOBAL_DEPTH)
+                        c = new_cexpr(cn_global);
+                else if (e->litexpr.depth == 0)
+                        c = new_cexpr(cn_local);
+                else
+                        c = new_cexpr(cn_upvar);
+                c->var.depth = e->litexpr.depth;
+                c->var.slot = e->litexpr.slot;
+                return c;
+        }
+
+        c = new_cexpr(cn_const);
+        switch (e->litexpr.token) {
+        case STRING:
+                c->lit = (Value) { .type = TYPE_STR, .str = STR_OF(e->litexpr.str) };
+                break;
+        case NUMBER:
+                c->lit = NUM(e->litexpr.num);
+                break;
+        case TRUE:
+                c->lit = NUM(1);
+                break;
+        case FALSE:
+                c->lit = NUM(0);
+                break;
+        default:
+                report("No yet implemented: cnode_litexpr for %s\n",
+                       TOKEN_REPR[e->litexpr.token]);
+                runtime_error();
+        }
+        return c;
+}
+
+static CExpr *
+cnode_binexpr(Expr *e)
+{
+        vtoktype op = e->binexpr.op;
+        Expr *rhs = EXPR(e->binexpr.rhs);
+        CExpr *c;
+
+        if (op >= UNKNOWN || !binop_table[op].fn) {
+                report("No yet implemented: cnode_binexpr for %s\n",
+                       TOKEN_REPR[op]);
+                runtime_error();
+        }
+
+        if (rhs->type == LITEXPR && rhs->litexpr.token == NUMBER) {
+                c = new_cexpr(binop_table[op].fn_k);
+                c->bink.lhs = cnode_expr(EXPR(e->binexpr.lhs));
+                c->bink.k = NUM(rhs->litexpr.num);
+                return c;
+        }
+
+        c = new_cexpr(binop_table[op].fn);
+        c->bin.lhs = cnode_expr(EXPR(e->binexpr.lhs));
+        c->bin.rhs = cnode_expr(rhs);
+        return c;
+}
+
+static CExpr *
+cnode_unexpr(Expr *e)
+{
+        CExpr *c;
+        switch (e->unexpr.op) {
+        case BANG:
+                c = new_cexpr(cn_not);
+                break;
+        case MINUS:
+                c = new_cexpr(cn_neg);
+                break;
+        case BITWISE_NOT:
+                c = new_cexpr(cn_bnot);
+                break;
+        default:
+                report("No yet implemented: cnode_unexpr for %s\n",
+                       TOKEN_REPR[e->unexpr.op]);
+                runtime_error();
+        }
+        c->un.rhs = cnode_expr(EXPR(e->unexpr.rhs));
+        return c;
+}
+
+static CExpr *
+cnode_assignexpr(Expr *e)
+{
+        CExpr *c;
+        if (e->assignexpr.depth == GLOBAL_DEPTH)
+                c = new_cexpr(cn_assign_global);
+        else if (e->assignexpr.depth == 0)
+                c = new_cexpr(cn_assign_local);
+        else
+                c = new_cexpr(cn_assign);
+        c->assign.value = cnode_expr(EXPR(e->assignexpr.value));
+        c->assign.depth = e->assignexpr.depth;
+        c->assign.slot = e->assignexpr.slot;
+        return c;
+}
+
+static CExpr *
+cnode_callexpr(Expr *e)
+{
+        CExpr *c = new_cexpr(cn_call);
+        NodeList args = e->callexpr.args;
+        c->call.callee = cnode_expr(EXPR(e->callexpr.name));
+        c->call.argc = args.count;
+        c->call.args = unit_alloc((c->call.argc + 1) * sizeof(CExpr *));
+        for (uint32_t i = 0; i < args.count; i++)
+                c->call.args[i] = cnode_expr(EXPR(LIST_AT(args, i)));
+        return c;
+}
+
+static CExpr *
+cnode_expr(Expr *e)
+{
+        CExpr *c;
+        switch (e->type) {
+        case LITEXPR:
+                return cnode_litexpr(e);
+        case BINEXPR:
+                return cnode_binexpr(e);
+        case UNEXPR:
+                return cnode_unexpr(e);
+        case ASSIGNEXPR:
+                return cnode_assignexpr(e);
+        case CALLEXPR:
+                return cnode_callexpr(e);
+        case OREXPR:
+                c = new_cexpr(cn_or);
+                c->bin.lhs = cnode_expr(EXPR(e->orexpr.lhs));
+                c->bin.rhs = cnode_expr(EXPR(e->orexpr.rhs));
+                return c;
+        case ANDEXPR:
+                c = new_cexpr(cn_and);
+                c->bin.lhs = cnode_expr(EXPR(e->andexpr.lhs));
+                c->bin.rhs = cnode_expr(EXPR(e->andexpr.rhs));
+                return c;
+        case VAREXPR:
+        default:
+                report("No yet implemented: cnode_expr for %s\n",
+                       EXPR_REPR[e->type]);
+                runtime_error();
+        }
+}
+
+CStmt *
+cnode_stmt(Stmt *s)
+{
+        CStmt *c;
+        int i;
+
+        switch (s->type) {
+        case EXPRSTMT:
+                c = new_cstmt(cs_expr);
+                c->expr.value = cnode_expr(EXPR(s->expr.body));
+                break;
+        case VARDECLSTMT:
+                c = new_cstmt(cs_vardecl);
+                c->vardecl.value = cnode_expr(EXPR(s->vardecl.value));
+                c->vardecl.slot = s->vardecl.slot;
+                break;
+        case FUNDECLSTMT:
+                c = new_cstmt(cs_funcdecl);
+                c->funcdecl.body = cnode_stmt(STMT(s->funcdecl.body));
+                c->funcdecl.name = s->funcdecl.name;
+                c->funcdecl.arity = s->funcdecl.params.count;
+                c->funcdecl.slot = s->funcdecl.slot;
+                c->funcdecl.captures = func_captures(s);
+                break;
+        case ASSERTSTMT:
+                c = new_cstmt(cs_assert);
+                c->expr.value = cnode_expr(EXPR(s->assert.body));
+                break;
+        case BLOCKSTMT:
+                c = new_cstmt(cs_block);
+                c->block.size = s->block.size;
+                c->block.count = s->block.body.count;
+                c->block.body = unit_alloc((c->block.count + 1) * sizeof(CStmt *));
+                for (i = 0; i < c->block.count; i++)
+                        c->block.body[i] = cnode_stmt(STMT(LIST_AT(s->block.body, i)));
+                break;
+        case IFSTMT:
+                c = new_cstmt(cs_if);
+                c->ifstmt.cond = cnode_expr(EXPR(s->ifstmt.cond));
+                c->ifstmt.body = cnode_stmt(STMT(s->ifstmt.body));
+                if (s->ifstmt.elsebody)
+                        c->ifstmt.elsebody = cnode_stmt(STMT(s->ifstmt.elsebody));
+                break;
+        case WHILESTMT:
+                c = new_cstmt(cs_while);
+                c->whilestmt.cond = cnode_expr(EXPR(s->whilestmt.cond));
+                c->whilestmt.body = cnode_stmt(STMT(s->whilestmt.body));
+                break;
+        case RETSTMT:
+                c = new_cstmt(cs_return);
+                c->expr.value = cnode_expr(EXPR(s->retstmt.value));
+                break;
+        default:
+                report("Todo: cnode_stmt for %s\n", STMT_REPR[s->type]);
+                runtime_error();
+        }
+        return c;
+}
+
+/* Same as eval(), see ./eval.c */
+void
+cnode_eval()
+{
+        Env *env = get_current_env();
+        Value v = NO_VALUE;
+
+        if (setjmp(eval_runtime_error)) {
+                env_unwind(env);
+                return;
+        }
+        for (uint32_t i = 0; i < ast_program.count; i++) {
+                Stmt *s = STMT(LIST_AT(ast_program, i));
+                v = NO_VALUE;
+                if (s->type == EXPRSTMT) {
+                        v = EVAL(cnode_expr(EXPR(s->expr.body)));
+                } else if (EXEC(cnode_stmt(s)) == EXEC_RETURN) {
+                        v = ret_val;
+                        env_unwind(env);
+                        break;
+                }
+        }
+        print_val(v);
+        printf("\n");
+}
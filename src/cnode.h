@@ -0,0 +1,47 @@
+#ifndef CNODE_H
+#define CNODE_H
+
+#include "interpreter.h"
+#include "tokens.h"
+
+/* Closure compiled AST. Each node carries the function that evaluates
+ * it and the operands that function needs, already extracted from the
+ * resolved Expr/Stmt, so running a node is a single indirect call. */
+
+struct CExpr;
+struct CStmt;
+
+typedef Value (*CExprFn)(struct CExpr *);
+typedef Exec (*CStmtFn)(struct CStmt *);
+
+// clang-format off
+typedef struct CExpr {
+        CExprFn fn;
+        union {
+                Value lit;
+                struct { int depth; int slot; } var;
+                struct { struct CExpr *value; int depth; int slot; } assign;
+                struct { struct CExpr *lhs; struct CExpr *rhs; } bin;
+                struct { struct CExpr *lhs; Value k; } bink;
+                struct { struct CExpr *rhs; } un;
+                struct { struct CExpr *callee; struct CExpr **args; int argc; } call;
+        };
+} CExpr;
+
+typedef struct CStmt {
+        CStmtFn fn;
+        union {
+                struct { CExpr *value; } expr;
+                struct { CExpr *value; int slot; } vardecl;
+                struct { struct CStmt **body; int count; int size; } block;
+                struct { CExpr *cond; struct CStmt *body; struct CStmt *elsebody; } ifstmt;
+                struct { CExpr *cond; struct CStmt *body; } whilestmt;
+                struct { struct CStmt *body; char *name; int arity; int slot; NodeList captures; } funcdecl;
+        };
+} CStmt;
+// clang-format on
+
+/* Convert a resolved statement */
+CStmt *cnode_stmt(Stmt *s);
+
+#endif // !CNODE_H
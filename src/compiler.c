@@ -0,0 +1,502 @@
+/* VISPEL interpreter - Compile AST to bytecode
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+#include "interpreter.h"
+#include "str.h"
+#include "tokens.h"
+#include "unit.h"
+#include "vm.h"
+
+#include "stb_ds.h"
+
+/* Prototype that is being emitted */
+static Proto *current = NULL;
+
+/* Index of each constant of a proto being compiled, so each one is
+ * stored once. Keyed by type and payload: strings are the same constant
+ * if they are the same literal */
+typedef struct ConstKey {
+        uint64_t bits;
+        int64_t type;
+} ConstKey;
+
+typedef struct ConstSlot {
+        ConstKey key;
+        int value;
+} ConstSlot;
+
+static _Noreturn void
+compile_error()
+{
+        longjmp(eval_runtime_error, 1);
+}
+
+static void
+free_proto(void *p)
+{
+        arrfree(((Proto *) p)->code);
+        arrfree(((Proto *) p)->k);
+        hmfree(((Proto *) p)->consts);
+}
+
+/* Protos live in the unit of the code they come from */
+static Proto *
+new_proto(char *name, int arity)
+{
+        Proto *p = unit_alloc(sizeof(Proto));
+        p->name = name;
+        p->arity = arity;
+        unit_on_free(p, free_proto, p);
+        return p;
+}
+
+static int
+here()
+{
+        return arrlen(current->code);
+}
+
+static void
+emit(uint8_t byte)
+{
+        arrput(current->code, byte);
+}
+
+static void
+emit16(int n)
+{
+        if (n < 0 || n > UINT16_MAX) {
+                report("Compiler Error: operand %d out of range\n", n);
+                compile_error();
+        }
+        emit(n & 0xFF);
+        emit((n >> 8) & 0xFF);
+}
+
+/* 32 bit operands are in host order, so the VM reads them at once */
+static void
+emit32(int n)
+{
+        int32_t v = n;
+        memcpy(arraddnptr(current->code, sizeof v), &v, sizeof v);
+}
+
+/* Instruction with a single operand, wide if it does not fit in 16 bits */
+static void
+emit_op16(Opcode op, int n)
+{
+        if (n > UINT16_MAX) {
+                emit(OP_WIDE);
+                emit(op);
+                emit32(n);
+                return;
+        }
+        emit(op);
+        emit16(n);
+}
+
+static int
+add_const(Value v)
+{
+        ConstKey key = {
+                .bits = v.type == TYPE_NUM ? (uint32_t) v.num : (uintptr_t) v.addr,
+                .type = v.type,
+        };
+        int i = hmgeti(current->consts, key);
+
+        if (i >= 0) return current->consts[i].value;
+        arrput(current->k, v);
+        hmput(current->consts, key, arrlen(current->k) - 1);
+        return arrlen(current->k) - 1;
+}
+
+static void
+emit_variable(Opcode op, Opcode global_op, Opcode cell_op, int depth, int slot)
+{
+        if (depth == GLOBAL_DEPTH) {
+                emit_op16(global_op, slot);
+                return;
+        }
+        if (depth & CELL_DEPTH) {
+                op = cell_op;
+                depth &= ~CELL_DEPTH;
+        }
+        emit_op16(op, depth);
+        emit16(slot);
+}
+
+/* Emit a forward jump and return where its operand is, to be patched
+ * later with patch_jump() */
+static int
+emit_jump(Opcode op)
+{
+        emit(op);
+        emit32(0);
+        return here() - 4;
+}
+
+static void
+patch_jump(int at)
+{
+        int32_t offset = here() - at - 4;
+        memcpy(current->code + at, &offset, sizeof offset);
+}
+
+static void
+emit_loop(int start)
+{
+        emit(OP_LOOP);
+        emit32(here() - start + 4);
+}
+
+static Opcode
+binop_opcode(vtoktype op)
+{
+        switch (op) {
+        case PLUS:
+                return OP_ADD;
+        case MINUS:
+                return OP_SUB;
+        case STAR:
+                return OP_MUL;
+        case SLASH:
+                return OP_DIV;
+        case BITWISE_AND:
+                return OP_BAND;
+        case BITWISE_OR:
+                return OP_BOR;
+        case BITWISE_XOR:
+                return OP_BXOR;
+        case SHIFT_LEFT:
+                return OP_SHL;
+        case SHIFT_RIGHT:
+                return OP_SHR;
+        case EQUAL_EQUAL:
+                return OP_EQ;
+        case BANG_EQUAL:
+                return OP_NE;
+        case GREATER:
+                return OP_GT;
+        case GREATER_EQUAL:
+                return OP_GE;
+        case LESS:
+                return OP_LT;
+        case LESS_EQUAL:
+                return OP_LE;
+        default:
+                report("No yet implemented: binop_opcode for %s\n",
+                       TOKEN_REPR[op]);
+                compile_error();
+        }
+}
+
+static Opcode
+unop_opcode(vtoktype op)
+{
+        switch (op) {
+        case BANG:
+                return OP_NOT;
+        case MINUS:
+                return OP_NEG;
+        case BITWISE_NOT:
+                return OP_BNOT;
+        default:
+                report("No yet implemented: unop_opcode for %s\n",
+                       TOKEN_REPR[op]);
+                compile_error();
+        }
+}
+
+static void compile_expr(Expr *e);
+
+static void
+compile_litexpr(Expr *e)
+{
+        switch (e->litexpr.token) {
+        case STRING:
+                emit_op16(OP_CONST, add_const((Value) { .type = TYPE_STR, .str = STR_OF(e->litexpr.str) }));
+                break;
+        case NUMBER:
+                emit_op16(OP_CONST, add_const((Value) { .type = TYPE_NUM, .num = e->litexpr.num }));
+                break;
+        case TRUE:
+                emit_op16(OP_CONST, add_const((Value) { .type = TYPE_NUM, .num = 1 }));
+                break;
+        case FALSE:
+                emit_op16(OP_CONST, add_const((Value) { .type = TYPE_NUM, .num = 0 }));
+                break;
+        case IDENTIFIER:
+                emit_variable(OP_GET, OP_GET_GLOBAL, OP_GET_CELL, e->litexpr.depth, e->litexpr.slot);
+                break;
+        default:
+                report("No yet implemented: compile_litexpr for %s\n",
+                       TOKEN_REPR[e->litexpr.token]);
+                compile_error();
+        }
+}
+
+static void
+compile_orexpr(Expr *e)
+{
+        int lhs_true, rhs_true;
+        compile_expr(EXPR(e->orexpr.lhs));
+        lhs_true = emit_jump(OP_JUMP_TRUE_OR_POP);
+        compile_expr(EXPR(e->orexpr.rhs));
+        rhs_true = emit_jump(OP_JUMP_TRUE_OR_POP);
+        emit_op16(OP_CONST, add_const((Value) { .type = TYPE_NUM, .num = 0 }));
+        patch_jump(lhs_true);
+        patch_jump(rhs_true);
+}
+
+static void
+compile_andexpr(Expr *e)
+{
+        int lhs_false, rhs_false, end;
+        compile_expr(EXPR(e->andexpr.lhs));
+        lhs_false = emit_jump(OP_JUMP_FALSE);
+        compile_expr(EXPR(e->andexpr.rhs));
+        rhs_false = emit_jump(OP_JUMP_FALSE);
+        emit_op16(OP_CONST, add_const((Value) { .type = TYPE_NUM, .num = 1 }));
+        end = emit_jump(OP_JUMP);
+        patch_jump(lhs_false);
+        patch_jump(rhs_false);
+        emit_op16(OP_CONST, add_const((Value) { .type = TYPE_NUM, .num = 0 }));
+        patch_jump(end);
+}
+
+static void
+compile_expr(Expr *e)
+{
+        switch (e->type) {
+        case LITEXPR:
+                compile_litexpr(e);
+                break;
+        case BINEXPR:
+                compile_expr(EXPR(e->binexpr.lhs));
+                compile_expr(EXPR(e->binexpr.rhs));
+                emit(binop_opcode(e->binexpr.op));
+                break;
+        case UNEXPR:
+                compile_expr(EXPR(e->unexpr.rhs));
+                emit(unop_opcode(e->unexpr.op));
+                break;
+        case ASSIGNEXPR:
+                compile_expr(EXPR(e->assignexpr.value));
+                emit_variable(OP_SET, OP_SET_GLOBAL, OP_SET_CELL,
+                              e->assignexpr.depth, e->assignexpr.slot);
+                break;
+        case OREXPR:
+                compile_orexpr(e);
+                break;
+        case ANDEXPR:
+                compile_andexpr(e);
+                break;
+        case CALLEXPR:
+                compile_expr(EXPR(e->callexpr.name));
+                for (uint32_t i = 0; i < e->callexpr.args.count; i++)
+                        compile_expr(EXPR(LIST_AT(e->callexpr.args, i)));
+                emit_op16(OP_CALL, e->callexpr.args.count);
+                break;
+        case VAREXPR:
+        default:
+                report("No yet implemented: compile_expr for %s\n",
+                       EXPR_REPR[e->type]);
+                compile_error();
+        }
+}
+
+static void compile_stmt(Stmt *s);
+
+static void
+compile_stmt_list(NodeList l)
+{
+        for (uint32_t i = 0; i < l.count; i++)
+                compile_stmt(STMT(LIST_AT(l, i)));
+}
+
+static void
+compile_funcdecl(Stmt *s)
+{
+        Proto *enclosing = current;
+        Proto *p = new_proto(s->funcdecl.name, s->funcdecl.params.count);
+
+        p->captures = func_captures(s);
+        current = p;
+        compile_stmt(STMT(s->funcdecl.body));
+        emit_op16(OP_CONST, add_const(NO_VALUE));
+        emit(OP_RETURN);
+        hmfree(p->consts);
+        current = enclosing;
+
+        emit_op16(OP_FUNC, add_const((Value) { .type = TYPE_ADDR, .addr = p }));
+        emit_op16(OP_DEFINE, s->funcdecl.slot);
+}
+
+static void
+compile_stmt(Stmt *s)
+{
+        int else_jump, end_jump, start;
+
+        switch (s->type) {
+        case EXPRSTMT:
+                compile_expr(EXPR(s->expr.body));
+                emit(OP_POP);
+                break;
+        case VARDECLSTMT:
+                compile_expr(EXPR(s->vardecl.value));
+                emit_op16(OP_DEFINE, s->vardecl.slot);
+                break;
+        case FUNDECLSTMT:
+                compile_funcdecl(s);
+                break;
+        case ASSERTSTMT:
+                compile_expr(EXPR(s->assert.body));
+                emit(OP_ASSERT);
+                break;
+        case BLOCKSTMT:
+                emit_op16(OP_ENV_PUSH, s->block.size);
+                compile_stmt_list(s->block.body);
+                emit(OP_ENV_POP);
+                break;
+        case IFSTMT:
+                compile_expr(EXPR(s->ifstmt.cond));
+                else_jump = emit_jump(OP_JUMP_FALSE);
+                compile_stmt(STMT(s->ifstmt.body));
+                if (s->ifstmt.elsebody) {
+                        end_jump = emit_jump(OP_JUMP);
+                        patch_jump(else_jump);
+                        compile_stmt(STMT(s->ifstmt.elsebody));
+                        patch_jump(end_jump);
+                } else
+                        patch_jump(else_jump);
+                break;
+        case WHILESTMT:
+                start = here();
+                compile_expr(EXPR(s->whilestmt.cond));
+                end_jump = emit_jump(OP_JUMP_FALSE);
+                compile_stmt(STMT(s->whilestmt.body));
+                emit_loop(start);
+                patch_jump(end_jump);
+                break;
+        case RETSTMT:
+                compile_expr(EXPR(s->retstmt.value));
+                emit(OP_RETURN);
+                break;
+        default:
+                report("Todo: compile_stmt for %s\n", STMT_REPR[s->type]);
+                compile_error();
+        }
+}
+
+/* Compile a program. The value of the last statement is left on the
+ * stack when OP_HALT is reached, as eval() prints it. */
+Proto *
+compile(NodeList program)
+{
+        Proto *p = new_proto("<main>", 0);
+        Stmt *s;
+
+        current = p;
+        for (uint32_t i = 0; i < program.count; i++) {
+                s = STMT(LIST_AT(program, i));
+                if (i == program.count - 1 && s->type == EXPRSTMT) {
+                        compile_expr(EXPR(s->expr.body));
+                        emit(OP_HALT);
+                        hmfree(p->consts);
+                        return p;
+                }
+                compile_stmt(s);
+        }
+        emit_op16(OP_CONST, add_const(NO_VALUE));
+        emit(OP_HALT);
+        hmfree(p->consts);
+        return p;
+}
+
+static int
+read16(uint8_t *ip)
+{
+        return ip[0] | (ip[1] << 8);
+}
+
+static int
+read32(uint8_t *ip)
+{
+        int32_t n;
+        memcpy(&n, ip, sizeof n);
+        return n;
+}
+
+void
+print_proto(Proto *p)
+{
+        printf("-----| %s |-----\n", p->name);
+        for (int i = 0; i < arrlen(p->code);) {
+                Opcode op = p->code[i];
+                printf("%04d %s", i, OPCODE_REPR[op]);
+                ++i;
+                if (op == OP_WIDE) {
+                        op = p->code[i];
+                        printf(" %s %d\n", OPCODE_REPR[op], read32(p->code + i + 1));
+                        i += 5;
+                        continue;
+                }
+                switch (op) {
+                case OP_GET:
+                case OP_SET:
+                case OP_GET_CELL:
+                case OP_SET_CELL:
+                        printf(" %d", read16(p->code + i));
+                        i += 2;
+                        /* fall through */
+                case OP_GET_GLOBAL:
+                case OP_SET_GLOBAL:
+                case OP_DEFINE:
+                case OP_ENV_PUSH:
+                        printf(" %d", read16(p->code + i));
+                        i += 2;
+                        break;
+                case OP_CONST:
+                        printf(" ");
+                        if (p->k[read16(p->code + i)].type == TYPE_NUM ||
+                            p->k[read16(p->code + i)].type == TYPE_STR)
+                                print_val(p->k[read16(p->code + i)]);
+                        i += 2;
+                        break;
+                case OP_JUMP:
+                case OP_JUMP_FALSE:
+                case OP_JUMP_TRUE_OR_POP:
+                        printf(" -> %04d", i + 4 + read32(p->code + i));
+                        i += 4;
+                        break;
+                case OP_LOOP:
+                        printf(" -> %04d", i + 4 - read32(p->code + i));
+                        i += 4;
+                        break;
+                case OP_CALL:
+                        printf(" %d", read16(p->code + i));
+                        i += 2;
+                        break;
+                case OP_FUNC:
+                        printf(" `%s`", ((Proto *) p->k[read16(p->code + i)].addr)->name);
+                        i += 2;
+                        break;
+                default:
+                        break;
+                }
+                printf("\n");
+        }
+        for (int i = 0; i < arrlen(p->k); i++) {
+                if (p->k[i].type == TYPE_ADDR) print_proto(p->k[i].addr);
+        }
+}
@@ -8,6 +8,7 @@
 #include <string.h>
 extern char *strdup(const char *);
 
+#include "../slab.h"
 #include "core.h"
 
 CoreFunc *core_func_list = NULL;
@@ -15,24 +16,22 @@ CoreFunc *core_func_list = NULL;
 static void
 load(CoreFunc *c)
 {
-        Value v;
-        v.type = TYPE_CORE_CALL;
-        v.call.arity = c->arity; // number of params
-        v.call.ifunc = c->func;  // C function
-        v.call.name = c->name;   // vispel function name
-        v.call.params = NULL;
-        v.call.closure = get_current_env();
-        env_add(v.call.name, v);
+        Value v = new_function(TYPE_CORE_CALL,
+                               c->arity, // number of params
+                               c->name,  // vispel function name
+                               0);       // cells
+        v.fn->ifunc = c->func; // C function
+        env_add(v.fn->name, v);
 }
 
 static CoreFunc *
 new_corefunc()
 {
-        return calloc(1, sizeof(CoreFunc));
+        return memset(slab_alloc(sizeof(CoreFunc)), 0, sizeof(CoreFunc));
 }
 
 void
-preload(const char *name, Value (*func)(Expr *), int arity)
+preload(const char *name, Value (*func)(Value *, int), int arity)
 {
         CoreFunc *c = new_corefunc();
         c->name = strdup(name);
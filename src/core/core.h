@@ -7,14 +7,18 @@
 
 typedef struct CoreFunc {
         char *name;
-        Value (*func)(Expr *);
+        Value (*func)(Value *, int);
         int arity;
         struct CoreFunc *next;
 } CoreFunc;
 
 extern CoreFunc *core_func_list;
 
-void preload(const char *name, Value (*func)(Expr *), int arity);
+/* ./list.c, used by the GETEXPR fast path in eval.c */
+Value list_get(Value l, Value i);
+Value core_list_get(Value *v, int argc);
+
+void preload(const char *name, Value (*func)(Value *, int), int arity);
 void load_core_lib();
 
 #endif // !CORE_LIB_H
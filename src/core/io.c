@@ -8,25 +8,26 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "../str.h"
 #include "core.h"
 
 Value
-core_print(Expr *args)
+core_print(Value *argv, int argc)
 {
-        print_val(eval_expr(args));
+        print_val(argv[0]);
         return NO_VALUE;
 }
 
 Value
-core_print_ln(Expr *args)
+core_print_ln(Value *argv, int argc)
 {
-        print_val(eval_expr(args));
+        print_val(argv[0]);
         printf("\n");
         return NO_VALUE;
 }
 
 Value
-core_input(Expr *_)
+core_input(Value *argv, int argc)
 {
         char buf[1024];
         char *c;
@@ -34,7 +35,7 @@ core_input(Expr *_)
                 if ((c = strchr(buf, '\n'))) {
                         *c = 0;
                 }
-                return (Value) { .type = TYPE_STR, .str = strdup(buf) };
+                return str_value(buf, strlen(buf));
         }
         return NO_VALUE;
 }
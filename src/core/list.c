@@ -10,46 +10,71 @@
 #include <stdlib.h> // alloc
 #include <string.h> // memmove
 
+#include "../gc.h"
+#include "../slab.h"
 #include "core.h"
 
-#define DA_REALLOC(dest, size) realloc((dest), (size));
-#define DA_MALLOC(size) malloc((size));
+/* Storage of lists comes from the size classes of slab.c, and counts as
+ * heap for the collector */
+#define DA_REALLOC(dest, old_size, size) list_realloc((dest), (old_size), (size));
+#define DA_FREE(dest, size) list_free((dest), (size));
+
+static void *
+list_realloc(void *p, size_t old_size, size_t size)
+{
+        gc_account((ptrdiff_t) size - (ptrdiff_t) old_size);
+        return slab_realloc(p, old_size, size);
+}
+
+static void
+list_free(void *p, size_t size)
+{
+        gc_account(-(ptrdiff_t) size);
+        slab_free(p, size);
+}
+
+/* The first LIST_INLINE elements are kept in the list itself, so short
+ * lists do not allocate storage. Longer ones double their capacity when
+ * full, so appending is linear */
+#define LIST_INLINE 4
 
 typedef struct {
         int capacity;
         int size;
-        Value *data;
+        Value *data; // inline or storage of capacity values
+        Value inline_data[LIST_INLINE];
 } *List;
 
-Value *
-get_values(Expr *e)
+/* Make room for N elements. Inline elements are moved to storage */
+static void
+list_grow(List l, int n)
 {
-        Value *v = NULL;
-        int i = 0;
-        while (e) {
-                v = realloc(v, sizeof *v * (i + 1));
-                v[i] = eval_expr(e);
-                e = e->next;
-                i++;
+        size_t es = sizeof *l->data;
+
+        if (n <= l->capacity) return;
+        if (l->data == l->inline_data) {
+                l->data = DA_REALLOC(NULL, 0, es * n);
+                memcpy(l->data, l->inline_data, es * l->size);
+        } else {
+                l->data = DA_REALLOC(l->data, es * l->capacity, es * n);
         }
-        return v;
+        l->capacity = n;
 }
 
-Value *
-get_values_n(Expr *e, int *n)
+static void
+check_valid_size(Value n)
 {
-        Value *v = NULL;
-        *n = 0;
-        while (e) {
-                v = realloc(v, sizeof *v * (*n + 1));
-                v[*n] = eval_expr(e);
-                e = e->next;
-                (*n)++;
+        if (n.type != TYPE_NUM) {
+                report("Argument `n` of type %s incompatible with NUM\n",
+                       VALTYPE_REPR[n.type]);
+                longjmp(eval_runtime_error, 1);
+        }
+        if (n.num < 0) {
+                report("Invalid list capacity: %d\n", n.num);
+                longjmp(eval_runtime_error, 1);
         }
-        return v;
 }
 
-
 static void
 check_valid_list(Value l)
 {
@@ -61,18 +86,13 @@ check_valid_list(Value l)
 }
 
 // add E to DA_PTR that is a pointer to a DA of the same type as E
-#define da_append(da_ptr, e)                                             \
-        ({                                                               \
-                if ((da_ptr)->size >= (da_ptr)->capacity) {              \
-                        (da_ptr)->capacity += 3;                         \
-                        (da_ptr)->data = DA_REALLOC(                     \
-                        (da_ptr)->data,                                  \
-                        sizeof(*((da_ptr)->data)) * (da_ptr)->capacity); \
-                        assert(da_ptr);                                  \
-                }                                                        \
-                assert((da_ptr)->size < (da_ptr)->capacity);             \
-                (da_ptr)->data[(da_ptr)->size++] = (e);                  \
-                (da_ptr)->size - 1;                                      \
+#define da_append(da_ptr, e)                                       \
+        ({                                                         \
+                if ((da_ptr)->size >= (da_ptr)->capacity)          \
+                        list_grow(da_ptr, 2 * (da_ptr)->capacity); \
+                assert((da_ptr)->size < (da_ptr)->capacity);       \
+                (da_ptr)->data[(da_ptr)->size++] = (e);            \
+                (da_ptr)->size - 1;                                \
         })
 
 void
@@ -83,21 +103,22 @@ list_append(Value l, Value e)
 }
 
 Value
-core_list_append(Expr *e)
+core_list_append(Value *v, int argc)
 {
-        Value *v = get_values(e);
         list_append(v[0], v[1]);
         return NO_VALUE;
 }
 
 /* Destroy DA pointed by DA_PTR. DA can be initialized again but previous
  * values are not accessible anymore. */
-#define da_destroy(da_ptr)              \
-        ({                              \
-                (da_ptr)->capacity = 0; \
-                (da_ptr)->size = 0;     \
-                free((da_ptr)->data);   \
-                (da_ptr)->data = NULL;  \
+#define da_destroy(da_ptr)                                                      \
+        ({                                                                      \
+                if ((da_ptr)->data != (da_ptr)->inline_data)                    \
+                        DA_FREE((da_ptr)->data,                                 \
+                                sizeof *((da_ptr)->data) * (da_ptr)->capacity); \
+                (da_ptr)->capacity = LIST_INLINE;                               \
+                (da_ptr)->size = 0;                                             \
+                (da_ptr)->data = (da_ptr)->inline_data;                         \
         })
 
 void
@@ -108,9 +129,8 @@ list_destroy(Value l)
 }
 
 Value
-core_list_destroy(Expr *e)
+core_list_destroy(Value *v, int argc)
 {
-        Value *v = get_values(e);
         list_destroy(v[0]);
         return NO_VALUE;
 }
@@ -139,9 +159,8 @@ list_insert(Value l, Value e, Value i)
 }
 
 Value
-core_list_insert(Expr *e)
+core_list_insert(Value *v, int argc)
 {
-        Value *v = get_values(e);
         list_insert(v[0], v[1], v[2]);
         return NO_VALUE;
 }
@@ -160,9 +179,8 @@ list_size(Value l)
 }
 
 Value
-core_list_size(Expr *e)
+core_list_size(Value *v, int argc)
 {
-        Value *v = get_values(e);
         return list_size(v[0]);
 }
 
@@ -193,9 +211,8 @@ list_remove(Value l, Value i)
 }
 
 Value
-core_list_remove(Expr *e)
+core_list_remove(Value *v, int argc)
 {
-        Value *v = get_values(e);
         list_remove(v[0], v[1]);
         return NO_VALUE;
 }
@@ -226,42 +243,76 @@ list_get(Value l, Value i)
 }
 
 Value
-core_list_get(Expr *e)
+core_list_get(Value *v, int argc)
 {
-        Value *v = get_values(e);
         return list_get(v[0], v[1]);
 }
 
-/* Initialize DA_PTR (that is a pointer to a DA). Initial size (int) can be
- * passed as second argument. */
-#define da_init(da_ptr, ...)                                                                \
-        ({                                                                                  \
-                (da_ptr)->capacity = 256;                                                   \
-                __VA_OPT__((da_ptr)->capacity = (__VA_ARGS__);)                             \
-                (da_ptr)->size = 0;                                                         \
-                (da_ptr)->data = NULL;                                                      \
-                (da_ptr)->data = DA_REALLOC((da_ptr)->data,                                 \
-                                            sizeof *((da_ptr)->data) * (da_ptr)->capacity); \
-                assert(da_ptr);                                                             \
-                da_ptr;                                                                     \
+/* Initialize DA_PTR (that is a pointer to a DA) with room for CAP
+ * elements. Up to LIST_INLINE are not allocated */
+#define da_init(da_ptr, cap)                                  \
+        ({                                                    \
+                (da_ptr)->capacity = LIST_INLINE;             \
+                (da_ptr)->size = 0;                           \
+                (da_ptr)->data = (da_ptr)->inline_data;       \
+                list_grow(da_ptr, cap);                       \
+                da_ptr;                                       \
         })
 
 Value
-core_list_init(Expr *e)
+core_list_init(Value *v, int argc)
 {
-        List l = da_init((List) calloc(1, sizeof *l));
-        int n;
-        Value *v = get_values_n(e, &n);
+        List l = gc_alloc(GC_LIST, sizeof *l);
+        da_init(l, argc);
 
-        for (int i = 0; i < n; i++)
+        for (int i = 0; i < argc; i++)
                 da_append(l, v[i]);
 
         return (Value) { .addr = l, .type = TYPE_ADDR };
 }
 
+/* Empty list with room for N elements, for lists whose final size is
+ * known, as the generations of a cellular automaton */
+Value
+core_list_with_capacity(Value *v, int argc)
+{
+        List l;
+
+        check_valid_size(v[0]);
+        l = gc_alloc(GC_LIST, sizeof *l);
+        da_init(l, v[0].num);
+        return (Value) { .addr = l, .type = TYPE_ADDR };
+}
+
+/* Make room for N elements in L, so the next appends up to N do not
+ * reallocate. Never shrinks */
+Value
+core_list_reserve(Value *v, int argc)
+{
+        check_valid_list(v[0]);
+        check_valid_size(v[1]);
+        list_grow((List) v[0].addr, v[1].num);
+        return NO_VALUE;
+}
+
+static void
+list_trace(void *l)
+{
+        List list = l;
+        for (int i = 0; i < list->size; i++)
+                gc_mark(list->data[i]);
+}
+
+static void
+list_finalize(void *l)
+{
+        da_destroy((List) l);
+}
+
 static __attribute__((constructor)) void
 __init__()
 {
+        gc_kind(GC_LIST, list_trace, list_finalize);
         preload("append", core_list_append, 2);
         preload("insert", core_list_insert, 3);
         preload("remove", core_list_remove, 2);
@@ -269,4 +320,6 @@ __init__()
         preload("length", core_list_size, 1);
         preload("get", core_list_get, 2);
         preload("list", core_list_init, 0 | VAARGS); // 0 or more arguments
+        preload("list_with_capacity", core_list_with_capacity, 1);
+        preload("reserve", core_list_reserve, 2);
 }
@@ -0,0 +1,29 @@
+/* VISPEL interpreter - Core lib - strings
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include "../str.h"
+#include "core.h"
+
+/* Interned copy of a string made at run time, as the ones read by
+ * input(), so comparing it with literals and other interned strings is
+ * a pointer compare. Interned strings are never freed. */
+Value
+core_intern(Value *v, int argc)
+{
+        if (v[0].type != TYPE_STR) {
+                report("Argument `s` of type %s incompatible with STRING\n",
+                       VALTYPE_REPR[v[0].type]);
+                longjmp(eval_runtime_error, 1);
+        }
+        return (Value) { .type = TYPE_STR, .str = str_value_intern(v[0]) };
+}
+
+static __attribute__((constructor)) void
+__init__()
+{
+        preload("intern", core_intern, 1);
+}
@@ -0,0 +1,587 @@
+/* VISPEL interpreter - Translate resolved AST to C
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+#include "interpreter.h"
+#include "tokens.h"
+
+#include "stb_ds.h"
+
+/* The program is written as a C file that uses the runtime (operators,
+ * core lib) from libvspl.a (make lib):
+ *
+ *   ./build/vspli --emit-c prog.vspl > prog.c
+ *   cc -std=gnu99 -I. prog.c -Wl,--whole-archive build/libvspl.a \
+ *      -Wl,--no-whole-archive -o prog
+ *
+ * (--whole-archive because the core lib registers itself from
+ * constructors). Add the same -fsanitize flags libvspl.a was built with.
+ *
+ * Globals are C variables and every other variable is a C local, as
+ * functions keep the cells of the variables they capture (see
+ * resolver.c) and not their scopes. A captured variable holds its cell,
+ * and inside the function that captured it, it is one of self->cells. */
+
+typedef struct Func {
+        FILE *f;
+        int is_main;
+        char *buf;
+        size_t size;
+        int arity;
+        int level; // current scope, parameters are level 0
+        int indent;
+} Func;
+
+static Func *fn = NULL;
+static char **functions = NULL; // generated code of each function
+static char **prototypes = NULL;
+static int function_count = 0;
+
+static void
+emit_error()
+{
+        longjmp(eval_runtime_error, 1);
+}
+
+static void
+out(const char *format, ...)
+{
+        va_list args;
+        va_start(args, format);
+        vfprintf(fn->f, format, args);
+        va_end(args);
+}
+
+static void
+line(const char *format, ...)
+{
+        va_list args;
+        fprintf(fn->f, "%*s", fn->indent * 8, "");
+        va_start(args, format);
+        vfprintf(fn->f, format, args);
+        va_end(args);
+        fprintf(fn->f, "\n");
+}
+
+static void
+emit_string(char *s)
+{
+        out("\"");
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\')
+                        out("\\%c", *s);
+                else if (*s >= ' ' && *s <= '~')
+                        out("%c", *s);
+                else
+                        out("\\%03o", (unsigned char) *s);
+        }
+        out("\"");
+}
+
+/* Write the cell of captured variable (DEPTH, SLOT), without CELL_DEPTH */
+static void
+emit_cell(int depth, int slot)
+{
+        int level = fn->level - depth;
+        if (!fn->is_main && level == 0 && slot >= fn->arity)
+                out("self->cells[%d]", slot - fn->arity);
+        else
+                out("env_cell(&l%d_%d)", level, slot);
+}
+
+/* Write the C lvalue of variable (DEPTH, SLOT) */
+static void
+emit_ref(int depth, int slot)
+{
+        if (depth == GLOBAL_DEPTH) {
+                out("G[%d]", slot);
+        } else if (depth & CELL_DEPTH) {
+                emit_cell(depth & ~CELL_DEPTH, slot);
+                out("->value");
+        } else {
+                out("l%d_%d", fn->level - depth, slot);
+        }
+}
+
+/* Variable declared in current scope */
+static void
+emit_decl_ref(int slot)
+{
+        if (fn->level < 0)
+                emit_ref(GLOBAL_DEPTH, slot);
+        else
+                out("DECL(l%d_%d)", fn->level, slot);
+}
+
+static const char *
+binop_c(vtoktype op)
+{
+        switch (op) {
+        case PLUS:
+                return "+";
+        case MINUS:
+                return "-";
+        case STAR:
+                return "*";
+        case SLASH:
+                return "/";
+        case BITWISE_AND:
+                return "&";
+        case BITWISE_OR:
+                return "|";
+        case BITWISE_XOR:
+                return "^";
+        case SHIFT_LEFT:
+                return "<<";
+        case SHIFT_RIGHT:
+                return ">>";
+        case EQUAL_EQUAL:
+                return "==";
+        case BANG_EQUAL:
+                return "!=";
+        case GREATER:
+                return ">";
+        case GREATER_EQUAL:
+                return ">=";
+        case LESS:
+                return "<";
+        case LESS_EQUAL:
+                return "<=";
+        default:
+                report("No yet implemented: emit binop %s\n", TOKEN_REPR[op]);
+                emit_error();
+                return NULL;
+        }
+}
+
+static void emit_expr(Expr *e);
+
+static void
+emit_litexpr(Expr *e)
+{
+        switch (e->litexpr.token) {
+        case STRING:
+                out("STR(");
+                emit_string(e->litexpr.str);
+                out(")");
+                break;
+        case NUMBER:
+                out("NUM(%d)", e->litexpr.num);
+                break;
+        case TRUE:
+                out("NUM(1)");
+                break;
+        case FALSE:
+                out("NUM(0)");
+                break;
+        case IDENTIFIER:
+                emit_ref(e->litexpr.depth, e->litexpr.slot);
+                break;
+        default:
+                report("No yet implemented: emit_litexpr for %s\n",
+                       TOKEN_REPR[e->litexpr.token]);
+                emit_error();
+        }
+}
+
+/* Tail calls return to vspl_call(), that does the call, so deep tail
+ * recursion does not grow the C stack */
+static void
+emit_callexpr(Expr *e, int tail)
+{
+        NodeList args = e->callexpr.args;
+        out("({ Value _f = ");
+        emit_expr(EXPR(e->callexpr.name));
+        out("; Value _v[%d]; vspl_check(_f, %d); ", args.count + 1, args.count);
+        for (uint32_t i = 0; i < args.count; i++) {
+                out("_v[%d] = ", i);
+                emit_expr(EXPR(LIST_AT(args, i)));
+                out("; ");
+        }
+        out("%s(_f, _v, %d); })", tail ? "vspl_tail" : "vspl_call", args.count);
+}
+
+/* Operands are evaluated in order into temporaries, as C does not
+ * specify the order for function arguments */
+static void
+emit_expr(Expr *e)
+{
+        switch (e->type) {
+        case LITEXPR:
+                emit_litexpr(e);
+                break;
+        case BINEXPR:
+                out("BIN(%s, %s, ", TOKEN_REPR[e->binexpr.op],
+                    binop_c(e->binexpr.op));
+                emit_expr(EXPR(e->binexpr.lhs));
+                out(", ");
+                emit_expr(EXPR(e->binexpr.rhs));
+                out(")");
+                break;
+        case UNEXPR:
+                switch (e->unexpr.op) {
+                case BANG:
+                        out("NUM(!is_true(");
+                        emit_expr(EXPR(e->unexpr.rhs));
+                        out("))");
+                        break;
+                case MINUS:
+                        out("UN(MINUS, -, ");
+                        emit_expr(EXPR(e->unexpr.rhs));
+                        out(")");
+                        break;
+                case BITWISE_NOT:
+                        out("UN(BITWISE_NOT, ~, ");
+                        emit_expr(EXPR(e->unexpr.rhs));
+                        out(")");
+                        break;
+                default:
+                        report("No yet implemented: emit unop %s\n",
+                               TOKEN_REPR[e->unexpr.op]);
+                        emit_error();
+                }
+                break;
+        case ASSIGNEXPR:
+                out("(");
+                emit_ref(e->assignexpr.depth, e->assignexpr.slot);
+                out(" = ");
+                emit_expr(EXPR(e->assignexpr.value));
+                out(")");
+                break;
+        case OREXPR:
+                out("({ Value _a = ");
+                emit_expr(EXPR(e->orexpr.lhs));
+                out("; is_true(_a) ? _a : ({ Value _b = ");
+                emit_expr(EXPR(e->orexpr.rhs));
+                out("; is_true(_b) ? _b : NUM(0); }); })");
+                break;
+        case ANDEXPR:
+                out("NUM(is_true(");
+                emit_expr(EXPR(e->andexpr.lhs));
+                out(") && is_true(");
+                emit_expr(EXPR(e->andexpr.rhs));
+                out("))");
+                break;
+        case CALLEXPR:
+                emit_callexpr(e, 0);
+                break;
+        default:
+                report("No yet implemented: emit_expr for %s\n",
+                       EXPR_REPR[e->type]);
+                emit_error();
+        }
+}
+
+static void
+func_begin(Func *f, int arity, int level)
+{
+        f->f = open_memstream(&f->buf, &f->size);
+        f->is_main = level < 0;
+        f->arity = arity;
+        f->level = level;
+        f->indent = 1;
+}
+
+static void emit_stmt(Stmt *s);
+
+static void
+emit_block(Stmt *s)
+{
+        line("{");
+        ++fn->indent;
+        ++fn->level;
+        for (int i = 0; i < s->block.size; i++)
+                line("Value l%d_%d = NO_VALUE;", fn->level, i);
+        for (uint32_t i = 0; i < s->block.body.count; i++)
+                emit_stmt(STMT(LIST_AT(s->block.body, i)));
+        --fn->level;
+        --fn->indent;
+        line("}");
+}
+
+/* Write function S to its own buffer and return its C name */
+static char *
+emit_function(Stmt *s)
+{
+        Func f, *enclosing = fn;
+        char *name = NULL;
+        int n = function_count++;
+        int arity = s->funcdecl.params.count;
+
+        size_t len = snprintf(NULL, 0, "vf%d_%s", n, s->funcdecl.name);
+        name = malloc(len + 1);
+        snprintf(name, len + 1, "vf%d_%s", n, s->funcdecl.name);
+
+        fn = &f;
+        func_begin(fn, arity, 0);
+        out("static Value\n%s(Function *self, Value *argv)\n{\n", name);
+        for (int i = 0; i < arity; i++)
+                line("Value l0_%d = argv[%d];", i, i);
+        emit_stmt(STMT(s->funcdecl.body));
+        line("return NO_VALUE;");
+        out("}\n");
+        fclose(fn->f);
+        fn = enclosing;
+
+        arrput(functions, f.buf);
+        arrput(prototypes, name);
+        return name;
+}
+
+static void
+emit_stmt(Stmt *s)
+{
+        NodeList captures;
+        char *name;
+        Expr *c;
+
+        switch (s->type) {
+        case EXPRSTMT:
+                out("%*s(void) ", fn->indent * 8, "");
+                emit_expr(EXPR(s->expr.body));
+                out(";\n");
+                break;
+        case VARDECLSTMT:
+                out("%*s", fn->indent * 8, "");
+                emit_decl_ref(s->vardecl.slot);
+                out(" = ");
+                emit_expr(EXPR(s->vardecl.value));
+                out(";\n");
+                break;
+        case FUNDECLSTMT:
+                name = emit_function(s);
+                captures = func_captures(s);
+                line("{");
+                ++fn->indent;
+                line("Value _c = FUNC(%s, \"%s\", %d, %d);", name, s->funcdecl.name,
+                     s->funcdecl.params.count, captures.count);
+                for (uint32_t i = 0; i < captures.count; i++) {
+                        c = EXPR(LIST_AT(captures, i));
+                        out("%*s_c.fn->cells[%d] = ", fn->indent * 8, "", i);
+                        emit_cell(c->litexpr.depth & ~CELL_DEPTH, c->litexpr.slot);
+                        out(";\n");
+                }
+                out("%*s", fn->indent * 8, "");
+                emit_decl_ref(s->funcdecl.slot);
+                out(" = _c;\n");
+                --fn->indent;
+                line("}");
+                break;
+        case ASSERTSTMT:
+                out("%*sif (!is_true(", fn->indent * 8, "");
+                emit_expr(EXPR(s->assert.body));
+                out(")) vspl_assert_failed();\n");
+                break;
+        case BLOCKSTMT:
+                emit_block(s);
+                break;
+        case IFSTMT:
+                out("%*sif (is_true(", fn->indent * 8, "");
+                emit_expr(EXPR(s->ifstmt.cond));
+                out("))\n");
+                ++fn->indent;
+                emit_stmt(STMT(s->ifstmt.body));
+                --fn->indent;
+                if (s->ifstmt.elsebody) {
+                        line("else");
+                        ++fn->indent;
+                        emit_stmt(STMT(s->ifstmt.elsebody));
+                        --fn->indent;
+                }
+                break;
+        case WHILESTMT:
+                out("%*swhile (is_true(", fn->indent * 8, "");
+                emit_expr(EXPR(s->whilestmt.cond));
+                out("))\n");
+                ++fn->indent;
+                emit_stmt(STMT(s->whilestmt.body));
+                --fn->indent;
+                break;
+        case RETSTMT:
+                out("%*s", fn->indent * 8, "");
+                /* Return outside functions ends the program */
+                out(fn->is_main ? "{ v = " : "return ");
+                if (s->retstmt.tail && !fn->is_main)
+                        emit_callexpr(EXPR(s->retstmt.value), 1);
+                else
+                        emit_expr(EXPR(s->retstmt.value));
+                out(fn->is_main ? "; goto end; }\n" : ";\n");
+                break;
+        default:
+                report("Todo: emit_stmt for %s\n", STMT_REPR[s->type]);
+                emit_error();
+        }
+}
+
+static const char *PRELUDE =
+"#include <setjmp.h>\n"
+"#include <stdio.h>\n"
+"#include <stdlib.h>\n"
+"#include <string.h>\n"
+"\n"
+"#include \"src/core/core.h\"\n"
+"#include \"src/env.h\"\n"
+"#include \"src/gc.h\"\n"
+"#include \"src/interpreter.h\"\n"
+"#include \"src/str.h\"\n"
+"#include \"src/tokens.h\"\n"
+"\n"
+"#define NUM(n) ((Value) { .type = TYPE_NUM, .num = (n) })\n"
+"#define STR(s)                                                                  \\\n"
+"        ({                                                                      \\\n"
+"                static Str *_s;                                                 \\\n"
+"                if (!_s) _s = str_intern((s), sizeof(s) - 1);                   \\\n"
+"                (Value) { .type = TYPE_STR, .str = _s };                        \\\n"
+"        })\n"
+"#define FUNC(f, n, a, c)                                                        \\\n"
+"        ({                                                                      \\\n"
+"                Value _f = new_function(TYPE_CALLABLE, (a), (n), (c));          \\\n"
+"                _f.fn->cfunc = (f);                                             \\\n"
+"                _f;                                                             \\\n"
+"        })\n"
+"/* Declared variable, in its cell if a function already captured it */\n"
+"#define DECL(l) (*((l).type == TYPE_CELL ? &(l).cell->value : &(l)))\n"
+"#define BIN(op, cop, a, b)                                                      \\\n"
+"        ({                                                                      \\\n"
+"                Value _l = (a);                                                 \\\n"
+"                Value _r = (b);                                                 \\\n"
+"                _l.type == TYPE_NUM && _r.type == TYPE_NUM ? NUM(_l.num cop _r.num) \\\n"
+"                                                           : eval_binop(op, _l, _r); \\\n"
+"        })\n"
+"#define UN(op, cop, a)                                                          \\\n"
+"        ({                                                                      \\\n"
+"                Value _u = (a);                                                 \\\n"
+"                _u.type == TYPE_NUM ? NUM(cop _u.num) : eval_unop(op, _u);      \\\n"
+"        })\n"
+"\n"
+"static void\n"
+"vspl_check(Value f, int argc)\n"
+"{\n"
+"        if (f.type != TYPE_CALLABLE && f.type != TYPE_CORE_CALL) {\n"
+"                report(\"Calling a non callable expression\\n\");\n"
+"                longjmp(eval_runtime_error, 1);\n"
+"        }\n"
+"        check_arity(f, argc);\n"
+"}\n"
+"\n"
+"/* return f(...) stores the call here and returns TAIL */\n"
+"static Value tail_func;\n"
+"static Value *tail_argv = NULL;\n"
+"static int tail_argc = 0;\n"
+"static int tail_cap = 0;\n"
+"#define TAIL ((Value) { .type = TYPE_NONE, .addr = &tail_func })\n"
+"#define IS_TAIL(v) ((v).type == TYPE_NONE && (v).addr == &tail_func)\n"
+"\n"
+"static Value\n"
+"vspl_tail(Value f, Value *argv, int argc)\n"
+"{\n"
+"        if (argc > tail_cap) {\n"
+"                tail_cap = argc;\n"
+"                tail_argv = realloc(tail_argv, sizeof(Value) * argc);\n"
+"        }\n"
+"        memcpy(tail_argv, argv, sizeof(Value) * argc);\n"
+"        tail_func = f;\n"
+"        tail_argc = argc;\n"
+"        return TAIL;\n"
+"}\n"
+"\n"
+"/* Functions copy their arguments on entry, so tail_argv can be reused */\n"
+"static Value\n"
+"vspl_call(Value f, Value *argv, int argc)\n"
+"{\n"
+"        Value v;\n"
+"        for (;;) {\n"
+"                if (f.type == TYPE_CORE_CALL) return f.fn->ifunc(argv, argc);\n"
+"                v = f.fn->cfunc(f.fn, argv);\n"
+"                if (!IS_TAIL(v)) return v;\n"
+"                f = tail_func;\n"
+"                argv = tail_argv;\n"
+"                argc = tail_argc;\n"
+"        }\n"
+"}\n"
+"\n"
+"static void\n"
+"vspl_assert_failed()\n"
+"{\n"
+"        report(\"Assert failed\\n\");\n"
+"        longjmp(eval_runtime_error, 1);\n"
+"}\n"
+"\n";
+
+/* Same as eval(), but writing the program as C to stdout */
+void
+emitc_eval()
+{
+        Func main_fn;
+        int globals = env_global_count();
+        Stmt *s;
+
+        arrsetlen(functions, 0);
+        arrsetlen(prototypes, 0);
+        function_count = 0;
+
+        if (setjmp(eval_runtime_error)) {
+                if (fn && fn->f) fclose(fn->f);
+                fn = NULL;
+                return;
+        }
+
+        fn = &main_fn;
+        func_begin(fn, 0, -1);
+        for (uint32_t i = 0; i < ast_program.count; i++) {
+                s = STMT(LIST_AT(ast_program, i));
+                if (s->type == EXPRSTMT) {
+                        out("%*sv = ", fn->indent * 8, "");
+                        emit_expr(EXPR(s->expr.body));
+                        out(";\n");
+                } else {
+                        line("v = NO_VALUE;");
+                        emit_stmt(s);
+                }
+        }
+        fclose(fn->f);
+        fn = NULL;
+
+        printf("/* Generated by vspli --emit-c */\n\n%s", PRELUDE);
+        printf("static Value G[%d];\n\n", globals + 1);
+        printf("static void\nmark_roots()\n{\n");
+        printf("        gc_mark_range(G, G + %d);\n", globals + 1);
+        printf("        gc_mark_range(tail_argv, tail_argv + tail_argc);\n");
+        printf("}\n\n");
+        for (int i = 0; i < arrlen(prototypes); i++)
+                printf("static Value %s(Function *self, Value *argv);\n", prototypes[i]);
+        printf("\n");
+        for (int i = 0; i < arrlen(functions); i++) {
+                printf("%s\n", functions[i]);
+                free(functions[i]);
+        }
+
+        printf("int\nmain()\n{\n");
+        printf("        Value v = NO_VALUE;\n\n");
+        printf("        env_create(0);\n");
+        printf("        load_core_lib();\n");
+        printf("        gc_add_roots(mark_roots);\n");
+        for (int i = 0; i < globals; i++) {
+                if (global_env->slots[i].type == TYPE_CORE_CALL)
+                        printf("        G[%d] = env_get(\"%s\");\n", i,
+                               env_global_name(i));
+        }
+        printf("        if (setjmp(eval_runtime_error)) return 1;\n\n");
+        printf("%s", main_fn.buf);
+        free(main_fn.buf);
+        printf("end:\n");
+        printf("        print_val(v);\n");
+        printf("        printf(\"\\n\");\n");
+        printf("        return 0;\n");
+        printf("}\n");
+}
@@ -1,175 +1,127 @@
-#include <assert.h>
 #include <setjmp.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 
 #include "env.h"
+#include "gc.h"
 #include "interpreter.h"
+#include "str.h"
 #include "tokens.h"
 
 Env *lower_env = NULL;
-
-static char *
-gen_env_random_name()
-{
-        static int counter = 0;
-        char name[12];
-        name[snprintf(name, 11, "Env %d", counter)] = 0;
-        counter++;
-        return strdup(name);
-}
-
+Env *global_env = NULL;
+
+/* Name to slot of global variables, and names by slot. Names are
+ * interned, so they are hashed by address */
+static struct {
+        char *key;
+        int value;
+} *global_map = NULL;
+static char **global_names = NULL;
+
+/* Envs of blocks and calls are taken from this stack instead of the
+ * collector, as functions keep the cells of the variables they capture
+ * and not envs (see resolver.c). They are destroyed in the reverse order
+ * they are created, so destroying one sets the top back to it. If the
+ * stack is full, envs are allocated by the collector as usual. */
+#define FRAME_STACK_MAX (1 << 20) // in Values
+static Value frame_stack[FRAME_STACK_MAX];
+static Value *frame_top = frame_stack;
+
+/* Values in frames are only reachable from here */
 static void
-print_env_list()
-{
-        printf("\e[90m");
-        Env *e = lower_env;
-        while (e) {
-                if (e != lower_env) printf(", ");
-                printf("%s", e->name);
-                e = e->upper;
-        }
-        printf("\e[0m");
-        printf("\n");
-}
-
-struct Env *
-get_current_env()
+mark_frames()
 {
-        return lower_env;
+        gc_mark_range(frame_stack, frame_top);
 }
 
-Env *
-env_change_upper(Env *newupper)
+static __attribute__((constructor)) void
+__init__()
 {
-        if (!lower_env) {
-                report("no env created!\n");
-                longjmp(eval_runtime_error, 1);
-        }
-
-        Env *ret = lower_env->upper;
-        lower_env->upper = newupper;
-        return ret;
+        gc_add_roots(mark_frames);
 }
 
-Value
-env_add_e(struct Env *e, char *name, Value value)
+static int
+env_is_frame(Env *e)
 {
-        if (!e) {
-                report("no env created!\n");
-                longjmp(eval_runtime_error, 1);
-        }
-        if (shgeti(e->map, name) >= 0) {
-                report("Var `%s` already declared\n", name);
-                longjmp(eval_runtime_error, 1);
-        }
-
-        return shput(e->map, name, value);
+        return (Value *) e >= frame_stack && (Value *) e < frame_stack + FRAME_STACK_MAX;
 }
 
-
-Value
-env_get_e(struct Env *env, char *name)
+static inline void
+pop_frame(Env *e)
 {
-        if (!env) {
-                report("no env created!\n");
-                longjmp(eval_runtime_error, 1);
-        }
-
-        Env *e = env;
-        node *ret;
-        while (e && (ret = shgetp_null(e->map, name)) == NULL) {
-                e = e->upper;
-        }
-        if (ret == NULL) {
-                report("env_get_e: var `%s` not declared\n", name);
-                longjmp(eval_runtime_error, 1);
-        }
-        return ret->value;
+        if (env_is_frame(e)) frame_top = (Value *) e;
 }
 
-int
-env_get_offset(char *name)
+struct Env *
+get_current_env()
 {
-        if (!lower_env) {
-                report("no env created!\n");
-                longjmp(resolve_error_jmp, 1);
-        }
-
-        int offset = 0;
-        Env *e = lower_env;
-        node *ret;
-        while (e && (ret = shgetp_null(e->map, name)) == NULL) {
-                e = e->upper;
-                ++offset;
-        }
-        if (ret == NULL) {
-                report("env_get_offset: Var `%s` not declared\n", name);
-                longjmp(resolve_error_jmp, 1);
-                return -1;
-        }
-        return offset;
+        return lower_env;
 }
 
 static Env *
-env_get_by_offset(int offset)
+new_env(int size)
 {
-        Env *e = lower_env;
-        int o = offset;
-        while (o > 0 && e) {
-                e = e->upper;
-                --o;
-        }
-        if (!e) {
-                report("Offset greater than possible jumps\n");
-                longjmp(eval_runtime_error, 1);
-        }
+        Env *e = gc_alloc(GC_ENV, sizeof(Env) + size * sizeof(Value));
+        e->slots = (Value *) (e + 1);
+        e->size = size;
         return e;
 }
 
-Value
-env_set_e(struct Env *env, char *name, Value value)
+static Env *
+push_frame(Env *upper, int size)
 {
-        if (!env) {
-                report("no env created!\n");
-                longjmp(eval_runtime_error, 1);
-        }
+        int header = (sizeof(Env) + sizeof(Value) - 1) / sizeof(Value);
+        Env *e;
 
-        Env *e = env;
-        node *ret;
-        while (e && (ret = shgetp_null(e->map, name)) == NULL) {
-                e = e->upper;
-        }
-        if (ret == NULL) {
-                report("Var %s not declared\n", name);
-                longjmp(eval_runtime_error, 1);
-        }
-        return ret->value = value;
+        if (frame_top + header + size > frame_stack + FRAME_STACK_MAX)
+                return env_new(upper, size);
+        e = (Env *) frame_top;
+        frame_top += header + size;
+        e->slots = (Value *) e + header;
+        e->size = size;
+        e->upper = upper;
+        memset(e->slots, 0, sizeof(Value) * size);
+        return e;
 }
 
 Env *
-new_env()
+env_new(Env *upper, int size)
 {
-        Env *e = calloc(1, sizeof(Env));
-        e->name = gen_env_random_name();
+        Env *e = new_env(size);
+        e->upper = upper;
         return e;
 }
 
 /* Create a new env and link with UPPER. Old current env is returned */
 Env *
-env_create_e(Env *upper)
+env_create_e(Env *upper, int size)
 {
         Env *ret = lower_env;
-        Env *e = new_env();
+        Env *e = new_env(size);
         e->upper = upper;
         lower_env = e;
         return ret;
 }
 
+Env *
+env_push_call(Function *f, Value *argv, int argc)
+{
+        Env *ret = lower_env;
+        Env *e = push_frame(NULL, argc + f->ncells);
+
+        memcpy(e->slots, argv, sizeof(Value) * argc);
+        for (int i = 0; i < f->ncells; i++)
+                e->slots[argc + i] = (Value) { .type = TYPE_CELL, .cell = f->cells[i] };
+        lower_env = e;
+        return ret;
+}
+
 /* Destroy current env and set current env to CURRENT */
 void
 env_destroy_e(Env *current)
@@ -178,17 +130,32 @@ env_destroy_e(Env *current)
                 report("Destroying a non existing env!\n");
                 longjmp(eval_runtime_error, 1);
         }
+        pop_frame(lower_env);
+        lower_env = current;
+}
+
+void
+env_unwind(Env *current)
+{
         lower_env = current;
+        frame_top = frame_stack;
 }
 
 void
-env_create()
+env_create(int size)
 {
-        Env *e = new_env();
-        if (lower_env != NULL) {
-                e->upper = lower_env;
+        if (global_env == NULL) {
+                /* Global slots grow as globals are declared */
+                global_env = lower_env = calloc(1, sizeof(Env));
+                return;
         }
-        lower_env = e;
+        env_create_e(lower_env, size);
+}
+
+void
+env_push(int size)
+{
+        lower_env = push_frame(lower_env, size);
 }
 
 void
@@ -198,41 +165,79 @@ env_destroy()
                 report("Destroying a non existing env!\n");
                 longjmp(eval_runtime_error, 1);
         }
+        pop_frame(lower_env);
         lower_env = lower_env->upper;
 }
 
-Value
-env_add(char *name, Value value)
+int
+env_global_slot(char *name)
 {
-        return env_add_e(lower_env, name, value);
+        int i = hmgeti(global_map, name);
+        return i < 0 ? -1 : global_map[i].value;
 }
 
-Value
-env_get(char *name)
+int
+env_global_declare(char *name)
+{
+        int slot = arrlen(global_names);
+        if (hmgeti(global_map, name) >= 0) return -1;
+        hmput(global_map, name, slot);
+        arrput(global_names, name);
+        if (slot >= global_env->size) {
+                global_env->size = global_env->size ? global_env->size * 2 : 64;
+                global_env->slots = realloc(global_env->slots,
+                                            sizeof(Value) * global_env->size);
+        }
+        global_env->slots[slot] = NO_VALUE;
+        return slot;
+}
+
+int
+env_global_count()
 {
-        return env_get_e(lower_env, name);
+        return arrlen(global_names);
 }
 
-Value
-env_set(char *name, Value value)
+char *
+env_global_name(int slot)
 {
-        return env_set_e(lower_env, name, value);
+        return global_names[slot];
 }
 
-Value
-env_add_o(int offset, char *name, Value value)
+/* Forget globals declared after the first COUNT ones */
+void
+env_global_truncate(int count)
+{
+        for (int i = count; i < arrlen(global_names); i++)
+                hmdel(global_map, global_names[i]);
+        arrsetlen(global_names, count);
+}
+
+/* Names interned here, as they come from C strings */
+static char *
+intern(char *name)
 {
-        return env_add_e(env_get_by_offset(offset), name, value);
+        return str_intern(name, strlen(name))->chars;
 }
 
 Value
-env_get_o(int offset, char *name)
+env_add(char *name, Value value)
 {
-        return env_get_e(env_get_by_offset(offset), name);
+        int slot = env_global_declare(name = intern(name));
+        if (slot < 0) {
+                report("Var `%s` already declared\n", name);
+                longjmp(eval_runtime_error, 1);
+        }
+        return global_env->slots[slot] = value;
 }
 
 Value
-env_set_o(int offset, char *name, Value value)
+env_get(char *name)
 {
-        return env_set_e(env_get_by_offset(offset), name, value);
+        int slot = env_global_slot(name = intern(name));
+        if (slot < 0) {
+                report("env_get: var `%s` not declared\n", name);
+                longjmp(eval_runtime_error, 1);
+        }
+        return global_env->slots[slot];
 }
@@ -10,40 +10,85 @@
 extern jmp_buf eval_runtime_error;
 extern jmp_buf resolve_error_jmp;
 
-/* Create a new environment and set it as the lower one. For searches
- * and addings, start looking from lower to upper. This function should
- * be called on scope enter (as a new block). Destroy is the opposite. */
-void env_create();
-void env_destroy();
+/* Resolver depth for variables that live in the global env */
+#define GLOBAL_DEPTH -1
 
-/* Add and get a variable. On error jump to eval_runtime_error */
-Value env_add(char *name, Value value);
-Value env_get(char *name);
-Value env_set(char *name, Value value);
+/* Or'ed to the resolver depth of variables captured by a function: the
+ * slot holds their cell (see resolver.c) */
+#define CELL_DEPTH 0x4000
+
+extern Env *lower_env;
+extern Env *global_env;
+
+/* Create a new environment with SIZE slots and set it as the lower one.
+ * This function should be called on scope enter (as a new block).
+ * Destroy is the opposite. The first env created is the global one. */
+void env_create(int size);
+void env_destroy();
 
-/* Closure stuff */
 struct Env *get_current_env();
-Value env_add_e(struct Env *e, char *name, Value value);
-Value env_get_e(struct Env *e, char *name);
-Value env_set_e(struct Env *e, char *name, Value value);
-/* Create a new env and link with UPPER. Old current env is returned */
-Env *env_create_e(Env *upper);
+/* Create a new env with SIZE slots and link with UPPER. Old current env
+ * is returned */
+Env *env_create_e(Env *upper, int size);
 /* Destroy current env and set current env to CURRENT */
 void env_destroy_e(Env *current);
-/* Return old upper and set upper to NEWUPPER */
-Env *env_change_upper(Env *newupper);
+/* Create a new env with SIZE slots linked with UPPER, without setting it
+ * as the current one */
+Env *env_new(Env *upper, int size);
+
+/* Same as env_create(), with the env taken from a stack, as nothing
+ * keeps envs once they are destroyed: functions keep cells instead.
+ * They have to be destroyed in the reverse order they were created. */
+void env_push(int size);
+/* Push the env of a call to F with the ARGC arguments in ARGV, followed
+ * by the cells of F, and return the old current env. It is not linked
+ * with any other, as the function only sees its globals and cells */
+Env *env_push_call(Function *f, Value *argv, int argc);
+/* Set CURRENT as the current env after a runtime error, dropping the
+ * envs that were not destroyed. Only called at top level */
+void env_unwind(Env *current);
+
+/* Global variables by name, for the resolver and the core lib. Declare
+ * returns the new slot or -1 if NAME is already declared. Names have to
+ * be interned (see str.h), but the ones given to env_add() and
+ * env_get(). */
+int env_global_slot(char *name);
+int env_global_declare(char *name);
+int env_global_count();
+char *env_global_name(int slot);
+void env_global_truncate(int count);
+Value env_add(char *name, Value value);
+Value env_get(char *name);
 
-/* Access by offset */
-Value env_add_o(int offset, char *name, Value value);
-Value env_get_o(int offset, char *name);
-Value env_set_o(int offset, char *name, Value value);
+/* Cell kept in slot V. A variable is put in a cell the first time it is
+ * captured or read as captured, as its declaration may not have been run */
+static inline Cell *
+env_cell(Value *v)
+{
+        if (v->type != TYPE_CELL) *v = new_cell(*v);
+        return v->cell;
+}
 
-/* Get the jumps needed to reach env there NAME is defined */
-int env_get_offset(char *name);
+/* Access by resolved (depth, slot) */
+static inline Value *
+env_ref(int depth, int slot)
+{
+        Env *e = lower_env;
+        if (depth == GLOBAL_DEPTH) return global_env->slots + slot;
+        if (depth & CELL_DEPTH)
+                return &env_cell(env_ref(depth & ~CELL_DEPTH, slot))->value;
+        while (depth-- > 0)
+                e = e->upper;
+        return e->slots + slot;
+}
 
-/* Access by Expr */
-// in resolver.c
-Value env_get_l(void* e, char *name);
-Value env_set_l(void* e, char *name, Value value);
+/* Variable SLOT declared in the current env. If a function declared in
+ * it already captured the variable, it is the value of the cell */
+static inline Value *
+env_decl_ref(int slot)
+{
+        Value *v = lower_env->slots + slot;
+        return v->type == TYPE_CELL ? &v->cell->value : v;
+}
 
 #endif // !ENV_H
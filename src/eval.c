@@ -11,13 +11,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "core/core.h"
 #include "env.h"
+#include "gc.h"
 #include "interpreter.h"
+#include "str.h"
 #include "tokens.h"
 
-/* return jump and value storage */
 Value ret_val;
-jmp_buf ret_env;
 
 jmp_buf eval_runtime_error;
 
@@ -53,7 +54,7 @@ print_val(Value v)
                 printf("%d", v.num);
                 break;
         case TYPE_STR:
-                printf("%s", v.str);
+                fwrite(STR_CHARS(v), 1, STR_LEN(v), stdout);
                 break;
         case TYPE_NONE:
                 break;
@@ -68,14 +69,13 @@ static Value
 eval_litexpr(Expr *e)
 {
         Value v;
-        switch (e->litexpr.value->token) {
+        switch (e->litexpr.token) {
         case STRING:
-                v.type = TYPE_STR;
-                v.str = e->litexpr.value->str_literal;
+                v = (Value) { .type = TYPE_STR, .str = STR_OF(e->litexpr.str) };
                 break;
         case NUMBER:
                 v.type = TYPE_NUM;
-                v.num = e->litexpr.value->num_literal;
+                v.num = e->litexpr.num;
                 break;
         case TRUE:
                 v.type = TYPE_NUM;
@@ -86,11 +86,11 @@ eval_litexpr(Expr *e)
                 v.num = 0;
                 break;
         case IDENTIFIER:
-                v = env_get_l(e, e->litexpr.value->str_literal);
+                v = *env_ref(e->litexpr.depth, e->litexpr.slot);
                 break;
         default:
                 report("No yet implemented: eval_litexpr for %s\n",
-                       TOKEN_REPR[e->litexpr.value->token]);
+                       TOKEN_REPR[e->litexpr.token]);
                 runtime_error();
         }
         return v;
@@ -112,14 +112,14 @@ panik_invalid_unop(vtoktype OP, Value R)
         runtime_error();
 }
 
-static int
+int
 is_true(Value v)
 {
         switch (v.type) {
         case TYPE_NUM:
                 return v.num;
         case TYPE_STR:
-                return v.str && *v.str;
+                return STR_LEN(v) > 0;
         default:
                 report("No yet implemented: is_true for %s\n",
                        VALTYPE_REPR[v.type]);
@@ -140,7 +140,7 @@ is_equal(Value v1, Value v2)
         case TYPE_NUM:
                 return v1.num == v2.num;
         case TYPE_STR:
-                return strcmp(v1.str, v2.str) == 0;
+                return str_value_equal(v1, v2);
         default:
                 report("No yet implemented: is_equal for %s and %s\n",
                        VALTYPE_REPR[v1.type], VALTYPE_REPR[v2.type]);
@@ -175,21 +175,19 @@ is_greater_equal(Value v1, Value v2)
         return is_equal(v1, v2) || is_greater(v1, v2);
 }
 
-static Value
-eval_binexpr(Expr *e)
+Value
+eval_binop(vtoktype op, Value lhs, Value rhs)
 {
         Value v;
-        Value lhs = eval_expr(e->binexpr.lhs);
-        Value rhs = eval_expr(e->binexpr.rhs);
 
-        switch (e->binexpr.op->token) {
+        switch (op) {
         case MINUS:
                 if (rhs.type == TYPE_NUM && lhs.type == TYPE_NUM) {
                         v.type = TYPE_NUM;
                         v.num = lhs.num - rhs.num;
                         break;
                 }
-                panik_invalid_binop(lhs, e->binexpr.op->token, rhs);
+                panik_invalid_binop(lhs, op, rhs);
 
         case PLUS:
                 if (rhs.type == TYPE_NUM && lhs.type == TYPE_NUM) {
@@ -197,7 +195,7 @@ eval_binexpr(Expr *e)
                         v.num = lhs.num + rhs.num;
                         break;
                 }
-                panik_invalid_binop(lhs, e->binexpr.op->token, rhs);
+                panik_invalid_binop(lhs, op, rhs);
 
         case SLASH:
                 if (rhs.type == TYPE_NUM && lhs.type == TYPE_NUM) {
@@ -205,7 +203,7 @@ eval_binexpr(Expr *e)
                         v.num = lhs.num / rhs.num;
                         break;
                 }
-                panik_invalid_binop(lhs, e->binexpr.op->token, rhs);
+                panik_invalid_binop(lhs, op, rhs);
 
         case STAR:
                 if (rhs.type == TYPE_NUM && lhs.type == TYPE_NUM) {
@@ -213,7 +211,7 @@ eval_binexpr(Expr *e)
                         v.num = lhs.num * rhs.num;
                         break;
                 }
-                panik_invalid_binop(lhs, e->binexpr.op->token, rhs);
+                panik_invalid_binop(lhs, op, rhs);
 
         case AND:
                 v.type = TYPE_NUM;
@@ -231,7 +229,7 @@ eval_binexpr(Expr *e)
                         v.num = rhs.num & lhs.num;
                         break;
                 }
-                panik_invalid_binop(lhs, e->binexpr.op->token, rhs);
+                panik_invalid_binop(lhs, op, rhs);
 
         case BITWISE_OR:
                 if (rhs.type == TYPE_NUM && lhs.type == TYPE_NUM) {
@@ -239,7 +237,7 @@ eval_binexpr(Expr *e)
                         v.num = rhs.num | lhs.num;
                         break;
                 }
-                panik_invalid_binop(lhs, e->binexpr.op->token, rhs);
+                panik_invalid_binop(lhs, op, rhs);
 
         case BITWISE_XOR:
                 if (rhs.type == TYPE_NUM && lhs.type == TYPE_NUM) {
@@ -247,7 +245,23 @@ eval_binexpr(Expr *e)
                         v.num = rhs.num ^ lhs.num;
                         break;
                 }
-                panik_invalid_binop(lhs, e->binexpr.op->token, rhs);
+                panik_invalid_binop(lhs, op, rhs);
+
+        case SHIFT_LEFT:
+                if (rhs.type == TYPE_NUM && lhs.type == TYPE_NUM) {
+                        v.type = TYPE_NUM;
+                        v.num = lhs.num << rhs.num;
+                        break;
+                }
+                panik_invalid_binop(lhs, op, rhs);
+
+        case SHIFT_RIGHT:
+                if (rhs.type == TYPE_NUM && lhs.type == TYPE_NUM) {
+                        v.type = TYPE_NUM;
+                        v.num = lhs.num >> rhs.num;
+                        break;
+                }
+                panik_invalid_binop(lhs, op, rhs);
 
         case EQUAL_EQUAL:
                 v.type = TYPE_NUM;
@@ -271,7 +285,7 @@ eval_binexpr(Expr *e)
 
         case LESS:
                 v.type = TYPE_NUM;
-                v.num = !is_greater_equal(lhs, rhs);
+                v.num = is_greater(rhs, lhs);
                 break;
 
         case LESS_EQUAL:
@@ -281,19 +295,89 @@ eval_binexpr(Expr *e)
 
         default:
                 report("Binexpr Operation no yet implemented: %s\n",
-                       TOKEN_REPR[e->litexpr.value->token]);
+                       TOKEN_REPR[op]);
                 runtime_error();
         }
         return v;
 }
 
+/* Specialized node for each operator, indexed by token. 0 if there is
+ * no specialized version. */
+static const Exprtype binexpr_num[] = {
+        [PLUS] = BINEXPR_ADD_NUM,
+        [MINUS] = BINEXPR_SUB_NUM,
+        [STAR] = BINEXPR_MUL_NUM,
+        [SLASH] = BINEXPR_DIV_NUM,
+        [BITWISE_AND] = BINEXPR_BAND_NUM,
+        [BITWISE_OR] = BINEXPR_BOR_NUM,
+        [BITWISE_XOR] = BINEXPR_BXOR_NUM,
+        [EQUAL_EQUAL] = BINEXPR_EQ_NUM,
+        [BANG_EQUAL] = BINEXPR_NE_NUM,
+        [GREATER] = BINEXPR_GT_NUM,
+        [GREATER_EQUAL] = BINEXPR_GE_NUM,
+        [LESS] = BINEXPR_LT_NUM,
+        [LESS_EQUAL] = BINEXPR_LE_NUM,
+        [UNKNOWN] = 0,
+};
+
+/* Generic binexpr. If both operands are numbers the node is rewritten
+ * to its specialized type, so next time it is evaluated without going
+ * through eval_binop(). Nodes that were deoptimized stay generic. */
 static Value
-eval_unexpr(Expr *e)
+eval_binexpr(Expr *e)
+{
+        Value lhs = eval_expr(EXPR(e->binexpr.lhs));
+        Value rhs = eval_expr(EXPR(e->binexpr.rhs));
+        vtoktype op = e->binexpr.op;
+
+        if (!e->binexpr.generic && binexpr_num[op] &&
+            lhs.type == TYPE_NUM && rhs.type == TYPE_NUM)
+                e->type = binexpr_num[op];
+
+        return eval_binop(op, lhs, rhs);
+}
+
+/* Operands of a specialized node are not numbers: go back to generic */
+static Value
+deopt_binexpr(Expr *e, Value lhs, Value rhs)
+{
+        e->type = BINEXPR;
+        e->binexpr.generic = 1;
+        return eval_binop(e->binexpr.op, lhs, rhs);
+}
+
+#define BINEXPR_NUM(NAME, OP)                                                   \
+        static Value NAME(Expr *e)                                              \
+        {                                                                       \
+                Value lhs = eval_expr(EXPR(e->binexpr.lhs));                    \
+                Value rhs = eval_expr(EXPR(e->binexpr.rhs));                    \
+                if (lhs.type == TYPE_NUM && rhs.type == TYPE_NUM)               \
+                        return (Value) { .type = TYPE_NUM, .num = lhs.num OP rhs.num }; \
+                return deopt_binexpr(e, lhs, rhs);                              \
+        }
+
+BINEXPR_NUM(eval_add_num, +)
+BINEXPR_NUM(eval_sub_num, -)
+BINEXPR_NUM(eval_mul_num, *)
+BINEXPR_NUM(eval_div_num, /)
+BINEXPR_NUM(eval_band_num, &)
+BINEXPR_NUM(eval_bor_num, |)
+BINEXPR_NUM(eval_bxor_num, ^)
+BINEXPR_NUM(eval_eq_num, ==)
+BINEXPR_NUM(eval_ne_num, !=)
+BINEXPR_NUM(eval_gt_num, >)
+BINEXPR_NUM(eval_ge_num, >=)
+BINEXPR_NUM(eval_lt_num, <)
+BINEXPR_NUM(eval_le_num, <=)
+
+#undef BINEXPR_NUM
+
+Value
+eval_unop(vtoktype op, Value lhs)
 {
         Value v;
-        Value lhs = eval_expr(e->unexpr.rhs);
 
-        switch (e->unexpr.op->token) {
+        switch (op) {
         case BANG:
                 v.type = TYPE_NUM;
                 v.num = !is_true(lhs);
@@ -304,39 +388,44 @@ eval_unexpr(Expr *e)
                         v.num = -lhs.num;
                         break;
                 }
-                panik_invalid_unop(e->unexpr.op->token, lhs);
+                panik_invalid_unop(op, lhs);
         case BITWISE_NOT:
                 if (lhs.type == TYPE_NUM) {
                         v.type = TYPE_NUM;
                         v.num = ~lhs.num;
                         break;
                 }
-                panik_invalid_unop(e->unexpr.op->token, lhs);
+                panik_invalid_unop(op, lhs);
         default:
                 report("unexpr operation no yet implemented: %s\n",
-                       TOKEN_REPR[e->litexpr.value->token]);
+                       TOKEN_REPR[op]);
                 runtime_error();
         }
         return v;
 }
 
+static Value
+eval_unexpr(Expr *e)
+{
+        return eval_unop(e->unexpr.op, eval_expr(EXPR(e->unexpr.rhs)));
+}
+
 Value eval_expr(Expr *e);
 
 static Value
 eval_assignexpr(Expr *s)
 {
-        char *name = s->assignexpr.name->str_literal;
-        Value v = eval_expr(s->assignexpr.value);
-        return env_set_l(s, name, v);
+        Value v = eval_expr(EXPR(s->assignexpr.value));
+        return *env_ref(s->assignexpr.depth, s->assignexpr.slot) = v;
 }
 
 static Value
 eval_orexpr(Expr *e)
 {
         Value v;
-        v = eval_expr(e->orexpr.lhs);
+        v = eval_expr(EXPR(e->orexpr.lhs));
         if (is_true(v)) return v;
-        v = eval_expr(e->orexpr.rhs);
+        v = eval_expr(EXPR(e->orexpr.rhs));
         if (is_true(v)) return v;
         return (Value) { .num = 0, .type = TYPE_NUM };
 }
@@ -345,18 +434,116 @@ static Value
 eval_andexpr(Expr *e)
 {
         Value v = (Value) { .num = 0, .type = TYPE_NUM };
-        if (is_true(eval_expr(e->orexpr.lhs)) &&
-            is_true(eval_expr(e->orexpr.rhs)))
+        if (is_true(eval_expr(EXPR(e->andexpr.lhs))) &&
+            is_true(eval_expr(EXPR(e->andexpr.rhs))))
                 v.num = 1;
         return v;
 }
 
-static Value eval_stmt(Stmt *s);
+/* Fused nodes from ./optimizer.c. If the fast path can not be used they
+ * are evaluated as the node they replaced. */
+static Value
+eval_incexpr(Expr *e)
+{
+        Value *v = env_ref(e->incexpr.depth, e->incexpr.slot);
+        if (v->type != TYPE_NUM) return eval_assignexpr(e);
+        v->num += e->incexpr.k;
+        return *v;
+}
+
+static int
+eval_cmpexpr(Expr *e)
+{
+        Value v = *env_ref(e->cmpexpr.depth, e->cmpexpr.slot);
+        int k = e->cmpexpr.k;
+
+        if (v.type != TYPE_NUM) return is_true(eval_binexpr(e));
+
+        switch (e->cmpexpr.op) {
+        case EQUAL_EQUAL:
+                return v.num == k;
+        case BANG_EQUAL:
+                return v.num != k;
+        case GREATER:
+                return v.num > k;
+        case GREATER_EQUAL:
+                return v.num >= k;
+        case LESS:
+                return v.num < k;
+        case LESS_EQUAL:
+                return v.num <= k;
+        default:
+                return is_true(eval_binexpr(e));
+        }
+}
+
+/* Condition of if and while: fused comparisons do not need to build a
+ * Value just to check if it is true */
+static inline int
+eval_cond(Expr *e)
+{
+        if (e->type == CMPEXPR) return eval_cmpexpr(e);
+        return is_true(eval_expr(e));
+}
+
+static Exec eval_stmt(Stmt *s);
+
+Value
+new_function(Valtype type, int arity, char *name, int ncells)
+{
+        Function *f = gc_alloc(GC_FUNC, sizeof(Function) + sizeof(Cell *) * ncells);
+        f->arity = arity;
+        f->ncells = ncells;
+        f->name = name;
+        return (Value) { .type = type, .fn = f };
+}
+
+Value
+new_closure(int arity, char *name, NodeList captures)
+{
+        Value v = new_function(TYPE_CALLABLE, arity, name, captures.count);
+        Expr *c;
+
+        for (uint32_t i = 0; i < captures.count; i++) {
+                c = EXPR(LIST_AT(captures, i));
+                v.fn->cells[i] = env_cell(env_ref(c->litexpr.depth & ~CELL_DEPTH,
+                                                  c->litexpr.slot));
+        }
+        return v;
+}
+
+Value
+new_cell(Value v)
+{
+        Cell *c = gc_alloc(GC_CELL, sizeof(Cell));
+        c->value = v;
+        return (Value) { .type = TYPE_CELL, .cell = c };
+}
+
+void
+check_arity(Value func, int argc)
+{
+        if (func.fn->arity & VAARGS) {
+                if (argc < (func.fn->arity & ~VAARGS)) {
+                        report("Function `%s` expect at least %d arguments, "
+                               "but got %d\n",
+                               func.fn->name, (func.fn->arity & ~VAARGS),
+                               argc);
+                        runtime_error();
+                }
+        } else if (argc != func.fn->arity) {
+                report("Function `%s` expect %d arguments, but got %d\n",
+                       func.fn->name, func.fn->arity, argc);
+                runtime_error();
+        }
+}
 
+/* Evaluate the callee of E and check that it can be called with the
+ * given number of arguments */
 static Value
-eval_callexpr(Expr *e)
+eval_callee(Expr *e)
 {
-        Value func = eval_expr(e->callexpr.name);
+        Value func = eval_expr(EXPR(e->callexpr.name));
         switch (func.type) {
         case TYPE_CALLABLE:
         case TYPE_CORE_CALL:
@@ -365,68 +552,124 @@ eval_callexpr(Expr *e)
                 report("Calling a non callable expression\n");
                 runtime_error();
         }
+        check_arity(func, e->callexpr.args.count);
+        return func;
+}
 
-        if (func.call.arity & VAARGS) {
-                if (e->callexpr.count < (func.call.arity & ~VAARGS)) {
-                        report("Function `%s` expect at least %b arguments, "
-                               "but got %b\n",
-                               func.call.name, (func.call.arity & ~VAARGS),
-                               e->callexpr.count);
-                        runtime_error();
-                }
-        } else if (e->callexpr.count != func.call.arity) {
-                report("Function `%s` expect %d arguments, but got %d\n",
-                       func.call.name, func.call.arity, e->callexpr.count);
-                runtime_error();
-        }
+static int
+eval_args(Expr *e, Value *argv)
+{
+        NodeList args = e->callexpr.args;
+        for (uint32_t i = 0; i < args.count; i++)
+                argv[i] = eval_expr(EXPR(LIST_AT(args, i)));
+        return args.count;
+}
 
-        Env *prev;
-        Value prev_ret_val;
-        jmp_buf prev_ret_env;
-        Value ret = NO_VALUE;
+/* Pending tail call, set by a tail return (see eval_stmt) */
+static Value tail_func;
+static Value *tail_argv = NULL;
+static int tail_argc = 0;
+static int tail_cap = 0;
 
-        Expr *arg = e->callexpr.args;
-        vtok *param = func.call.params;
+/* Values that are not in any env while returning */
+static void
+mark_roots()
+{
+        gc_mark(ret_val);
+        gc_mark(tail_func);
+        for (int i = 0; i < tail_argc; i++)
+                gc_mark(tail_argv[i]);
+}
 
-        env_create();
+static __attribute__((constructor)) void
+__init__()
+{
+        gc_add_roots(mark_roots);
+}
 
-        if (param) {
-                while (arg) {
-                        env_add(param->str_literal, eval_expr(arg));
-                        arg = arg->next;
-                        param = param->next;
+static void
+set_tail_call(Value func, Value *argv, int argc)
+{
+        if (argc > tail_cap) {
+                tail_cap = argc * 2;
+                tail_argv = realloc(tail_argv, sizeof(Value) * tail_cap);
+        }
+        memcpy(tail_argv, argv, sizeof *argv * argc);
+        tail_argc = argc;
+        tail_func = func;
+}
+
+/* Functions and loops start being evaluated as parsed. After HOT_COUNT
+ * calls or iterations they are optimized and calls can be compiled by the
+ * JIT, so short lived code does not pay for it. */
+#define HOT_COUNT 64
+
+static int
+is_hot(int *count, Stmt *s)
+{
+        if (*count >= HOT_COUNT) return 1;
+        if (++*count < HOT_COUNT) return 0;
+        optimize(s);
+        return 1;
+}
+
+/* Call FUNC. Tail calls done by its body are run in this same loop, so
+ * they do not grow the C stack: the frame of the caller is popped before
+ * pushing the one of the callee. */
+static Value
+call_value(Value func, Value *argv, int argc)
+{
+        Env *prev;
+        Exec ex;
+
+        if (func.type == TYPE_CORE_CALL) return func.fn->ifunc(argv, argc);
+        if (is_hot(&func.fn->body->block.calls, func.fn->body) &&
+            jit_call(func, argv, argc, &ret_val))
+                return ret_val;
+
+        prev = env_push_call(func.fn, argv, argc);
+        while ((ex = eval_stmt(func.fn->body)) == EXEC_TAIL) {
+                func = tail_func;
+                if (func.type == TYPE_CORE_CALL) {
+                        ret_val = func.fn->ifunc(tail_argv, tail_argc);
+                        ex = EXEC_RETURN;
+                        break;
                 }
-                if (arg || param) {
-                        report("Compiler Error: function args list and params"
-                               "list has not the same length\n");
-                        exit(1);
+                if (is_hot(&func.fn->body->block.calls, func.fn->body) &&
+                    jit_call(func, tail_argv, tail_argc, &ret_val)) {
+                        ex = EXEC_RETURN;
+                        break;
                 }
+                env_destroy_e(prev);
+                env_push_call(func.fn, tail_argv, tail_argc);
         }
+        env_destroy_e(prev);
+        return ex == EXEC_RETURN ? ret_val : NO_VALUE;
+}
 
-        switch (func.type) {
-        case TYPE_CALLABLE:
-                prev = env_change_upper(func.call.closure);
-                prev_ret_val = ret_val;
-                memcpy(prev_ret_env, ret_env, sizeof ret_env);
-                if (setjmp(ret_env))
-                        ret = ret_val;
-                else
-                        ret = eval_stmt(func.call.body);
-                ret_val = prev_ret_val;
-                memcpy(ret_env, prev_ret_env, sizeof ret_env);
-                env_destroy_e(prev);
-                break;
-        case TYPE_CORE_CALL:
-                ret = func.call.ifunc(e->callexpr.args);
-                env_destroy();
-                break;
+static Value
+eval_callexpr(Expr *e)
+{
+        Value func = eval_callee(e);
+        Value argv[e->callexpr.args.count + 1];
+        int argc = eval_args(e, argv);
+        return call_value(func, argv, argc);
+}
 
-        default:
-                report("No yet implemented: eval_callexpr for %s\n",
-                       VALTYPE_REPR[func.type]);
-                runtime_error();
-        }
-        return ret;
+/* get(list, index) without building argv, if `get` is still the core
+ * function. The callee is an identifier, so evaluating it again on the
+ * slow path has no side effects. */
+static Value
+eval_getexpr(Expr *e)
+{
+        Value func = eval_expr(EXPR(e->callexpr.name));
+        Value l;
+
+        if (func.type != TYPE_CORE_CALL || func.fn->ifunc != core_list_get)
+                return eval_callexpr(e);
+
+        l = eval_expr(EXPR(LIST_AT(e->callexpr.args, 0)));
+        return list_get(l, eval_expr(EXPR(LIST_AT(e->callexpr.args, 1))));
 }
 
 Value
@@ -437,6 +680,32 @@ eval_expr(Expr *e)
                 return eval_litexpr(e);
         case BINEXPR:
                 return eval_binexpr(e);
+        case BINEXPR_ADD_NUM:
+                return eval_add_num(e);
+        case BINEXPR_SUB_NUM:
+                return eval_sub_num(e);
+        case BINEXPR_MUL_NUM:
+                return eval_mul_num(e);
+        case BINEXPR_DIV_NUM:
+                return eval_div_num(e);
+        case BINEXPR_BAND_NUM:
+                return eval_band_num(e);
+        case BINEXPR_BOR_NUM:
+                return eval_bor_num(e);
+        case BINEXPR_BXOR_NUM:
+                return eval_bxor_num(e);
+        case BINEXPR_EQ_NUM:
+                return eval_eq_num(e);
+        case BINEXPR_NE_NUM:
+                return eval_ne_num(e);
+        case BINEXPR_GT_NUM:
+                return eval_gt_num(e);
+        case BINEXPR_GE_NUM:
+                return eval_ge_num(e);
+        case BINEXPR_LT_NUM:
+                return eval_lt_num(e);
+        case BINEXPR_LE_NUM:
+                return eval_le_num(e);
         case UNEXPR:
                 return eval_unexpr(e);
         case ASSIGNEXPR:
@@ -447,6 +716,12 @@ eval_expr(Expr *e)
                 return eval_andexpr(e);
         case CALLEXPR:
                 return eval_callexpr(e);
+        case INCEXPR:
+                return eval_incexpr(e);
+        case CMPEXPR:
+                return (Value) { .type = TYPE_NUM, .num = eval_cmpexpr(e) };
+        case GETEXPR:
+                return eval_getexpr(e);
         case VAREXPR:
         default:
                 report("No yet implemented: eval_expr for %s\n", EXPR_REPR[e->type]);
@@ -456,105 +731,118 @@ eval_expr(Expr *e)
         return NO_VALUE;
 }
 
-static Value eval_stmt_arr(Stmt *s);
-
-static ValueNode *
-new_valuenode()
-{
-        return calloc(1, sizeof(ValueNode));
-}
+static Exec eval_stmt_list(NodeList l);
 
-static ValueNode *
-parse_params(Expr *e)
+static void
+eval_funcdeclstmt(Stmt *s)
 {
-        ValueNode *vn = new_valuenode();
-        ValueNode *v = vn;
-        while (e) {
-                v->v = eval_expr(e);
-                v->next = new_valuenode();
-                v = v->next;
-                e = e->next;
-        }
-        return vn;
+        Value v = new_closure(s->funcdecl.params.count, s->funcdecl.name,
+                              func_captures(s));
+        v.fn->body = STMT(s->funcdecl.body);
+        *env_decl_ref(s->funcdecl.slot) = v;
 }
 
+/* Evaluate callee and arguments of a call in tail position, and leave
+ * the call to the caller of the current function */
 static void
-eval_funcdeclstmt(Stmt *s)
+eval_tail_call(Expr *e)
 {
-        Value v;
-        v.type = TYPE_CALLABLE;
-        v.call.arity = s->funcdecl.arity;
-        v.call.params = s->funcdecl.params;
-        v.call.name = s->funcdecl.name->str_literal;
-        v.call.body = s->funcdecl.body;
-        v.call.closure = get_current_env();
-        env_add(s->funcdecl.name->str_literal, v);
+        Value func = eval_callee(e);
+        Value argv[e->callexpr.args.count + 1];
+        int argc = eval_args(e, argv);
+        set_tail_call(func, argv, argc);
 }
 
-static Value
+static Exec
 eval_stmt(Stmt *s)
 {
+        Exec ex = EXEC_NEXT;
+        Value v;
+
         switch (s->type) {
         case EXPRSTMT:
-                return eval_expr(s->expr.body);
+                eval_expr(EXPR(s->expr.body));
+                break;
         case VARDECLSTMT:
-                env_add(s->vardecl.name->str_literal,
-                        eval_expr(s->vardecl.value));
+                v = eval_expr(EXPR(s->vardecl.value));
+                *env_decl_ref(s->vardecl.slot) = v;
                 break;
         case FUNDECLSTMT:
                 eval_funcdeclstmt(s);
                 break;
         case ASSERTSTMT:
-                if (!is_true(eval_expr(s->assert.body))) {
+                if (!is_true(eval_expr(EXPR(s->assert.body)))) {
                         report("Assert failed\n");
                         runtime_error();
                 }
                 break;
         case BLOCKSTMT:
-                env_create();
-                eval_stmt_arr(s->block.body);
+                env_push(s->block.size);
+                ex = eval_stmt_list(s->block.body);
                 env_destroy();
                 break;
         case IFSTMT:
-                if (is_true(eval_expr(s->ifstmt.cond))) {
-                        eval_stmt(s->ifstmt.body);
+                if (eval_cond(EXPR(s->ifstmt.cond))) {
+                        ex = eval_stmt(STMT(s->ifstmt.body));
                 } else if (s->ifstmt.elsebody) {
-                        eval_stmt(s->ifstmt.elsebody);
+                        ex = eval_stmt(STMT(s->ifstmt.elsebody));
                 }
                 break;
         case WHILESTMT:
-                while (is_true(eval_expr(s->whilestmt.cond))) {
-                        eval_stmt(s->whilestmt.body);
+                while (ex == EXEC_NEXT && eval_cond(EXPR(s->whilestmt.cond))) {
+                        ex = eval_stmt(STMT(s->whilestmt.body));
+                        is_hot(&s->whilestmt.iters, s);
                 }
                 break;
         case RETSTMT:
-                ret_val = eval_expr(s->retstmt.value);
-                longjmp(ret_env, 1);
+                if (s->retstmt.tail) {
+                        eval_tail_call(EXPR(s->retstmt.value));
+                        ex = EXEC_TAIL;
+                        break;
+                }
+                ret_val = eval_expr(EXPR(s->retstmt.value));
+                ex = EXEC_RETURN;
+                break;
         default:
                 report("Todo: eval_stmt for %s\n", STMT_REPR[s->type]);
                 runtime_error();
                 break;
         }
-        return NO_VALUE;
+        return ex;
 }
 
-static Value
-eval_stmt_arr(Stmt *s)
+static Exec
+eval_stmt_list(NodeList l)
 {
-        Value v = NO_VALUE;
-        while (s) {
-                v = eval_stmt(s);
-                s = s->next;
-        }
-        return v;
+        Exec ex = EXEC_NEXT;
+        for (uint32_t i = 0; i < l.count && ex == EXEC_NEXT; i++)
+                ex = eval_stmt(STMT(LIST_AT(l, i)));
+        return ex;
 }
 
+/* Top level statements are evaluated here, as the value of the last one
+ * is printed. A return outside functions ends the program. */
 inline void
 eval()
 {
+        Env *env = get_current_env();
+        Value v = NO_VALUE;
+
         if (setjmp(eval_runtime_error)) {
+                env_unwind(env);
                 return;
         }
-        print_val(eval_stmt_arr(head_stmt));
+        for (uint32_t i = 0; i < ast_program.count; i++) {
+                Stmt *s = STMT(LIST_AT(ast_program, i));
+                v = NO_VALUE;
+                if (s->type == EXPRSTMT) {
+                        v = eval_expr(EXPR(s->expr.body));
+                } else if (eval_stmt(s) == EXEC_RETURN) {
+                        v = ret_val;
+                        env_unwind(env);
+                        break;
+                }
+        }
+        print_val(v);
         printf("\n");
 }
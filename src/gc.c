@@ -0,0 +1,423 @@
+/* VISPEL interpreter - Mark and sweep garbage collector
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "env.h"
+#include "gc.h"
+#include "interpreter.h"
+#include "slab.h"
+#include "tokens.h"
+#include "unit.h"
+
+#include "stb_ds.h"
+
+/* Envs, lists, strings, functions and cells created at run time live
+ * here. Values in envs and lists are marked by their type. Temporaries
+ * the evaluators keep in C locals are found scanning the C stack: any
+ * word that is the address of an object keeps it alive. Pointers that
+ * are not objects are passed to unit_mark(), as function bodies and VM
+ * protos keep alive the unit of code they come from. Units are freed
+ * after the sweep if nothing points into them.
+ *
+ * Small objects are taken from blocks of BLOCK_SIZE bytes that hold
+ * objects of a single size, so checking if an address is an object is a
+ * lookup of its block and a division. Bigger ones are malloc'd one by
+ * one. */
+
+#define GC_MIN_HEAP (1 << 20)
+#define BLOCK_SIZE (64 * 1024)
+#define GRANULE 16
+#define MAX_SMALL 512
+#define GC_FREE GC_KIND_COUNT
+
+typedef struct GcObj {
+        struct GcObj *next; // free list, or list of big objects
+        uint32_t size;      // requested size
+        uint16_t kind;
+        uint16_t marked;
+} GcObj;
+
+typedef struct Block {
+        struct Block *next;
+        size_t obj_size; // including header
+        GcObj objects[];
+} Block;
+
+static struct {
+        void (*trace)(void *);
+        void (*finalize)(void *);
+} kinds[GC_KIND_COUNT];
+
+static Block *blocks = NULL;
+static struct {
+        Block *key;
+        int value;
+} *block_set = NULL;
+static GcObj *free_list[MAX_SMALL / GRANULE + 1];
+
+static GcObj *big_objects = NULL;
+static struct {
+        void *key;
+        GcObj *value;
+} *big_set = NULL;
+
+static uintptr_t heap_lo = UINTPTR_MAX;
+static uintptr_t heap_hi = 0;
+
+static GcObj **gray = NULL;
+static void (**root_markers)() = NULL;
+
+static size_t heap_bytes = 0;
+static size_t next_gc = GC_MIN_HEAP;
+
+int gc_stats = 0;
+static struct {
+        int collections;
+        size_t allocated;
+        size_t freed;
+        double pause_total;
+        double pause_max;
+} stats;
+
+extern void *__libc_stack_end;
+
+void
+gc_kind(GcKind kind, void (*trace)(void *), void (*finalize)(void *))
+{
+        kinds[kind].trace = trace;
+        kinds[kind].finalize = finalize;
+}
+
+void
+gc_add_roots(void (*mark)())
+{
+        arrput(root_markers, mark);
+}
+
+/* Header of the object at address P, or NULL if P is not an object */
+static GcObj *
+find_obj(void *p)
+{
+        static Block *last = NULL;
+        uintptr_t a = (uintptr_t) p;
+        Block *b = (Block *) (a & ~(uintptr_t) (BLOCK_SIZE - 1));
+        ptrdiff_t i;
+        uintptr_t off;
+        GcObj *o;
+
+        if (a < heap_lo || a > heap_hi) return NULL;
+        if (b == last || hmgeti(block_set, b) >= 0) {
+                last = b;
+                off = a - (uintptr_t) b->objects;
+                if (a < (uintptr_t) (b->objects + 1) || off % b->obj_size != sizeof(GcObj))
+                        return NULL;
+                o = (GcObj *) p - 1;
+                if (a + b->obj_size - sizeof(GcObj) > (uintptr_t) b + BLOCK_SIZE) return NULL;
+                return o->kind == GC_FREE ? NULL : o;
+        }
+        if ((i = hmgeti(big_set, p)) < 0) return NULL;
+        return big_set[i].value;
+}
+
+static void
+mark_ptr(void *p)
+{
+        GcObj *o = find_obj(p);
+
+        if (!o) {
+                unit_mark(p);
+                return;
+        }
+        if (o->marked) return;
+        o->marked = 1;
+        arrput(gray, o);
+}
+
+void
+gc_mark(Value v)
+{
+        switch (v.type) {
+        case TYPE_STR:
+                if (!v.small) mark_ptr(v.str);
+                break;
+        case TYPE_ADDR:
+                mark_ptr(v.addr);
+                break;
+        case TYPE_CALLABLE:
+        case TYPE_CORE_CALL:
+                mark_ptr(v.fn);
+                break;
+        case TYPE_CELL:
+                mark_ptr(v.cell);
+                break;
+        default:
+                break;
+        }
+}
+
+/* Mark every word in [START, END) that points to an object */
+__attribute__((no_sanitize_address)) void
+gc_mark_range(void *start, void *end)
+{
+        for (void **p = start; p < (void **) end; p++)
+                mark_ptr(*p);
+}
+
+/* Scan from a local of this frame to the start of the stack. It is not
+ * inlined, so the registers spilled by mark_stack() are above it */
+static __attribute__((noinline, no_sanitize_address)) void
+mark_stack_from_here()
+{
+        void *here = NULL;
+        gc_mark_range(&here, __libc_stack_end);
+}
+
+static void
+mark_stack()
+{
+        /* Save callee saved registers on the stack */
+        __builtin_unwind_init();
+        mark_stack_from_here();
+}
+
+static void
+trace_env(Env *e)
+{
+        for (int i = 0; i < e->size; i++)
+                gc_mark(e->slots[i]);
+        mark_ptr(e->upper);
+}
+
+static void
+trace_function(Function *f)
+{
+        unit_mark(f->body);
+        for (int i = 0; i < f->ncells; i++)
+                mark_ptr(f->cells[i]);
+}
+
+static void
+mark_roots()
+{
+        for (int i = 0; i < env_global_count(); i++)
+                gc_mark(global_env->slots[i]);
+        mark_ptr(lower_env);
+        for (int i = 0; i < arrlen(root_markers); i++)
+                root_markers[i]();
+        mark_stack();
+}
+
+static void
+trace()
+{
+        GcObj *o;
+        while (arrlen(gray) > 0) {
+                o = arrpop(gray);
+                switch (o->kind) {
+                case GC_ENV:
+                        trace_env((Env *) (o + 1));
+                        break;
+                case GC_FUNC:
+                        trace_function((Function *) (o + 1));
+                        break;
+                case GC_CELL:
+                        gc_mark(((Cell *) (o + 1))->value);
+                        break;
+                case GC_STR:
+                        break;
+                default:
+                        if (kinds[o->kind].trace) kinds[o->kind].trace(o + 1);
+                        break;
+                }
+        }
+}
+
+/* Run finalizer of unmarked object O. Return 1 if it was freed */
+static int
+sweep_obj(GcObj *o)
+{
+        if (o->marked) {
+                o->marked = 0;
+                return 0;
+        }
+        if (kinds[o->kind].finalize) kinds[o->kind].finalize(o + 1);
+        heap_bytes -= o->size;
+        stats.freed += o->size;
+        return 1;
+}
+
+static void
+sweep()
+{
+        GcObj **big = &big_objects;
+        GcObj *o, *dead;
+        int cls;
+
+        for (Block *b = blocks; b; b = b->next) {
+                cls = b->obj_size / GRANULE;
+                for (char *p = (char *) b->objects;
+                     p + b->obj_size <= (char *) b + BLOCK_SIZE; p += b->obj_size) {
+                        o = (GcObj *) p;
+                        if (o->kind == GC_FREE || !sweep_obj(o)) continue;
+                        o->kind = GC_FREE;
+                        o->next = free_list[cls];
+                        free_list[cls] = o;
+                }
+        }
+
+        while (*big) {
+                if (!sweep_obj(*big)) {
+                        big = &(*big)->next;
+                        continue;
+                }
+                dead = *big;
+                *big = dead->next;
+                hmdel(big_set, (void *) (dead + 1));
+                free(dead);
+        }
+}
+
+static double
+now_ms()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void
+collect()
+{
+        double start = now_ms();
+        double pause;
+
+        mark_roots();
+        trace();
+        sweep();
+        unit_sweep();
+
+        next_gc = heap_bytes * 2 > GC_MIN_HEAP ? heap_bytes * 2 : GC_MIN_HEAP;
+        pause = now_ms() - start;
+        ++stats.collections;
+        stats.pause_total += pause;
+        if (pause > stats.pause_max) stats.pause_max = pause;
+}
+
+static void
+update_heap_range(void *start, void *end)
+{
+        if ((uintptr_t) start < heap_lo) heap_lo = (uintptr_t) start;
+        if ((uintptr_t) end > heap_hi) heap_hi = (uintptr_t) end;
+}
+
+/* Add a block for objects of class CLS to its free list */
+static void
+new_block(int cls)
+{
+        Block *b;
+        GcObj *o;
+
+        if (posix_memalign((void **) &b, BLOCK_SIZE, BLOCK_SIZE)) {
+                report("Out of memory\n");
+                longjmp(eval_runtime_error, 1);
+        }
+        b->obj_size = cls * GRANULE;
+        b->next = blocks;
+        blocks = b;
+        hmput(block_set, b, 1);
+        update_heap_range(b, (char *) b + BLOCK_SIZE);
+
+        for (char *p = (char *) b->objects;
+             p + b->obj_size <= (char *) b + BLOCK_SIZE; p += b->obj_size) {
+                o = (GcObj *) p;
+                o->kind = GC_FREE;
+                o->next = free_list[cls];
+                free_list[cls] = o;
+        }
+}
+
+void
+gc_account(ptrdiff_t bytes)
+{
+        heap_bytes += bytes;
+        if (bytes > 0) stats.allocated += bytes;
+        else stats.freed -= bytes;
+}
+
+void *
+gc_alloc(GcKind kind, size_t size)
+{
+        size_t total = (sizeof(GcObj) + size + GRANULE - 1) & ~(size_t) (GRANULE - 1);
+        int cls = total / GRANULE;
+        GcObj *o;
+
+        if (heap_bytes + size > next_gc) collect();
+
+        if (total <= MAX_SMALL) {
+                if (!free_list[cls]) new_block(cls);
+                o = free_list[cls];
+                free_list[cls] = o->next;
+                memset(o, 0, total);
+        } else {
+                o = calloc(1, total);
+                o->next = big_objects;
+                big_objects = o;
+                hmput(big_set, (void *) (o + 1), o);
+                update_heap_range(o, (char *) o + total);
+        }
+        o->kind = kind;
+        o->size = size;
+
+        heap_bytes += size;
+        stats.allocated += size;
+        return o + 1;
+}
+
+/* Count the small objects in use and the slots for them in each class */
+static void
+block_occupancy(size_t used[], size_t slots[], size_t nblocks[])
+{
+        int cls;
+        for (Block *b = blocks; b; b = b->next) {
+                cls = b->obj_size / GRANULE;
+                ++nblocks[cls];
+                for (char *p = (char *) b->objects;
+                     p + b->obj_size <= (char *) b + BLOCK_SIZE; p += b->obj_size) {
+                        used[cls] += ((GcObj *) p)->kind != GC_FREE;
+                        ++slots[cls];
+                }
+        }
+}
+
+void
+gc_print_stats()
+{
+        size_t used[MAX_SMALL / GRANULE + 1] = { 0 };
+        size_t slots[MAX_SMALL / GRANULE + 1] = { 0 };
+        size_t nblocks[MAX_SMALL / GRANULE + 1] = { 0 };
+        size_t live = hmlen(big_set);
+
+        block_occupancy(used, slots, nblocks);
+        for (int i = 0; i <= MAX_SMALL / GRANULE; i++)
+                live += used[i];
+
+        fprintf(stderr, "gc: %d collections, %.3f ms paused (max %.3f ms)\n",
+                stats.collections, stats.pause_total, stats.pause_max);
+        fprintf(stderr, "gc: %zu bytes allocated, %zu freed, %zu in use by %zu objects\n",
+                stats.allocated, stats.freed, heap_bytes, live);
+        for (int i = 0; i <= MAX_SMALL / GRANULE; i++) {
+                if (!nblocks[i]) continue;
+                fprintf(stderr, "gc: %4d B: %zu of %zu in use (%.1f%%) in %zu blocks\n",
+                        i * GRANULE, used[i], slots[i], 100.0 * used[i] / slots[i], nblocks[i]);
+        }
+        slab_print_stats();
+}
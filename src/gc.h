@@ -0,0 +1,43 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+
+#include "interpreter.h"
+
+/* Objects owned by the collector */
+typedef enum GcKind {
+        GC_ENV,
+        GC_LIST,
+        GC_STR,
+        GC_FUNC,
+        GC_CELL,
+        GC_KIND_COUNT,
+} GcKind;
+
+/* Allocate SIZE zeroed bytes owned by the collector. A collection can be
+ * run before, so anything the caller still needs has to be reachable
+ * from the roots: global and current envs, the C stack and the ones
+ * marked by the functions added with gc_add_roots(). */
+void *gc_alloc(GcKind kind, size_t size);
+
+/* Called on each collection to mark roots that live in static or heap
+ * memory, as the VM stack */
+void gc_add_roots(void (*mark)());
+void gc_mark(Value v);
+void gc_mark_range(void *start, void *end);
+
+/* Count BYTES (negative when released) that an object owns outside the
+ * heap, as the storage of a list, so they trigger collections too */
+void gc_account(ptrdiff_t bytes);
+
+/* How to trace objects of KIND and release what they own (not the object
+ * itself). Envs, strings, functions and cells are known by the
+ * collector */
+void gc_kind(GcKind kind, void (*trace)(void *), void (*finalize)(void *));
+
+/* --gc-stats */
+extern int gc_stats;
+void gc_print_stats();
+
+#endif // !GC_H
@@ -3,12 +3,17 @@
 
 #include "tokens.h"
 #include <setjmp.h>
+#include <stdint.h>
 
 #define VAARGS (1 << ((sizeof(int) * 8) - 1))
 
 #define NO_VALUE ((Value) { .type = TYPE_NONE })
 
 struct ValueNode;
+struct Str;
+struct Proto;
+struct CStmt;
+struct Cell;
 
 typedef enum Valtype {
         TYPE_NUM,
@@ -17,6 +22,7 @@ typedef enum Valtype {
         TYPE_NONE,
         TYPE_CALLABLE,
         TYPE_CORE_CALL,
+        TYPE_CELL,
 } Valtype;
 
 static const char *VALTYPE_REPR[] = {
@@ -26,45 +32,71 @@ static const char *VALTYPE_REPR[] = {
         [TYPE_NONE] = "NONE",
         [TYPE_CALLABLE] = "CALLABLE",
         [TYPE_CORE_CALL] = "CORE CALL",
+        [TYPE_CELL] = "CELL",
 };
 
 struct Env;
 
+/* Values are 16 bytes: an 8 byte payload and the type. Functions do not
+ * fit, so they are a pointer to a Function owned by the collector.
+ * Short strings made at run time are kept in the payload (see str.h) */
 typedef struct Value {
         union {
                 int num;
-                char *str;
+                struct Str *str;
                 void *addr; // reserve for core functions
-                struct {
-                        int arity;
-                        vtok *params;
-                        char *name;
-                        union {
-                                Stmt *body;
-                                struct Value (*ifunc)(Expr *);
-                        };
-                        struct Env *closure;
-                } call;
+                struct Function *fn;
+                struct Cell *cell;
+                char chars[8];
         };
         Valtype type;
+        uint32_t small; // TYPE_STR in chars: length + 1, else 0
 } Value;
 
+/* Shared by every value of the same function, as copies of the value
+ * only copy the pointer. A function keeps the cells of the variables it
+ * captured (see resolver.c), not the envs where it was declared */
+typedef struct Function {
+        int arity;
+        int ncells;
+        char *name;
+        union {
+                Stmt *body;
+                struct Value (*ifunc)(struct Value *, int);
+                struct Proto *proto; // --vm functions
+                struct CStmt *cbody; // --closure functions
+                struct Value (*cfunc)(struct Function *, struct Value *); // --emit-c
+        };
+        struct Cell *cells[];
+} Function;
+
+/* Variable captured by a function. The env that declares it holds it as
+ * a TYPE_CELL value, so it is shared with every function that captured
+ * it and outlives the env */
+typedef struct Cell {
+        Value value;
+} Cell;
+
 typedef struct ValueNode {
         Value v;
         struct ValueNode *next;
 } ValueNode;
 
-typedef struct node {
-        char *key;
-        Value value;
-} node;
-
+/* Variables are stored by the slot the resolver assigned to them */
 typedef struct Env {
-        node *map;
-        char *name;
+        Value *slots;
+        int size;
         struct Env *upper;
 } Env;
 
+/* Result of executing a statement. Returns unwind until the call that
+ * is waiting for them, with the returned value stored apart */
+typedef enum Exec {
+        EXEC_NEXT,
+        EXEC_RETURN,
+        EXEC_TAIL, // return f(...): the caller does the call
+} Exec;
+
 /* Get the result of eval a single expression */
 Value eval_expr(Expr *e);
 
@@ -72,7 +104,45 @@ Value eval_expr(Expr *e);
 void eval();
 void print_val(Value v);
 
+/* Operations shared by every evaluation mode. On error jump to
+ * eval_runtime_error */
+Value eval_binop(vtoktype op, Value lhs, Value rhs);
+Value eval_unop(vtoktype op, Value rhs);
+int is_true(Value v);
+void check_arity(Value func, int argc);
+
+/* Value of TYPE (TYPE_CALLABLE or TYPE_CORE_CALL) for a new Function
+ * with room for NCELLS cells. The caller sets the body the function has
+ * in its mode */
+Value new_function(Valtype type, int arity, char *name, int ncells);
+/* Same, for a function that keeps the cells of CAPTURES (see
+ * func_captures()), taken from the current env */
+Value new_closure(int arity, char *name, NodeList captures);
+/* TYPE_CELL value for a new cell that holds V */
+Value new_cell(Value v);
+
+/* ./vm.c: Same as eval() but compiling the AST to bytecode first */
+void vm_eval();
+
+/* ./cnode.c: Same as eval() but converting the AST to closures first */
+void cnode_eval();
+
 int resolve();
 
+/* ./emitc.c: Same as eval() but writing the program as C to stdout */
+void emitc_eval();
+
+/* ./jit.c: Run FUNC as native code if it can be compiled and the
+ * arguments are numbers. Return 0 if it has to be interpreted */
+extern int jit_enabled;
+int jit_call(Value func, Value *argv, int argc, Value *ret);
+
+/* ./optimizer.c: Fold constants and replace common patterns of the
+ * resolved AST with fused nodes that only eval() knows about. Called on
+ * hot function bodies and loops only */
+void optimize(Stmt *s);
+extern int opt_stats;
+void optimize_print_stats();
+
 
 #endif
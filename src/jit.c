@@ -0,0 +1,615 @@
+/* VISPEL interpreter - x86-64 JIT for integer only functions
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+#include "interpreter.h"
+#include "tokens.h"
+#include "unit.h"
+
+#include "stb_ds.h"
+
+int jit_enabled = 1;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+/* Functions are compiled on first call if every statement and expression
+ * in them is one of:
+ * - var declaration, block, if, while, expression, return
+ * - number, true, false, local variable or parameter, assignment to them
+ * - arithmetic, bitwise, comparison, !, -, ~, && and ||
+ * - call to the function itself
+ * and the body always ends in a return, so the result is always a number.
+ *
+ * Values are 32 bit ints kept in eax, locals live in 8 byte stack slots
+ * under rbp. The native function takes a pointer to the first argument
+ * in rdi, and the following ones are below it (that is what pushing the
+ * arguments in order leaves on the stack), so self calls are direct.
+ *
+ * The function does not access anything outside its frame, so the only
+ * thing that can make it wrong is the name used for self calls being
+ * bound to another function. That is checked before entering it. */
+
+typedef long (*JitFn)(long *argv);
+
+typedef struct Jit {
+        JitFn code; // NULL if the function can not be compiled
+        int size;
+        int self_cell; // binding used in self calls: a cell of the function
+        int self_slot; // or a global
+        int has_self;
+} Jit;
+
+/* Slots of each env inside the function. Level 0 are the parameters */
+typedef struct {
+        int base;
+} Level;
+
+static struct {
+        uint8_t *code;
+        Level *levels;
+        int nlocals;
+        int arity;
+        int body_start;
+        char *name;
+        Jit *jit;
+} cg;
+
+static jmp_buf jit_bail;
+
+static _Noreturn void
+bail()
+{
+        longjmp(jit_bail, 1);
+}
+
+static void
+emit(int n, ...)
+{
+        va_list ap;
+        va_start(ap, n);
+        for (int i = 0; i < n; i++)
+                arrput(cg.code, (uint8_t) va_arg(ap, int));
+        va_end(ap);
+}
+
+static void
+emit32(int32_t v)
+{
+        emit(4, v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, (v >> 24) & 0xFF);
+}
+
+static int
+here()
+{
+        return arrlen(cg.code);
+}
+
+/* Emit OP with a rel32 operand to be patched, return where the operand is */
+static int
+emit_jump(int n, int op0, int op1)
+{
+        if (n == 1)
+                emit(1, op0);
+        else
+                emit(2, op0, op1);
+        emit32(0);
+        return here() - 4;
+}
+
+static void
+patch_to(int at, int target)
+{
+        int32_t rel = target - (at + 4);
+        memcpy(cg.code + at, &rel, 4);
+}
+
+static void
+patch(int at)
+{
+        patch_to(at, here());
+}
+
+static int32_t
+local_disp(int index)
+{
+        return -8 * (index + 1);
+}
+
+/* Local index of variable (DEPTH, SLOT), or -1 if it is not inside the
+ * function */
+static int
+local_index(int depth, int slot)
+{
+        int level = arrlen(cg.levels) - 1 - depth;
+        if (depth == GLOBAL_DEPTH || level < 0) return -1;
+        return cg.levels[level].base + slot;
+}
+
+static void
+load_local(int index)
+{
+        emit(2, 0x8b, 0x85); // mov eax, [rbp + disp32]
+        emit32(local_disp(index));
+}
+
+static void
+store_local(int index)
+{
+        emit(2, 0x89, 0x85); // mov [rbp + disp32], eax
+        emit32(local_disp(index));
+}
+
+static void
+level_push(int size)
+{
+        Level l = { .base = cg.nlocals };
+        cg.nlocals += size;
+        arrput(cg.levels, l);
+}
+
+static void
+level_pop()
+{
+        arrpop(cg.levels);
+}
+
+/* Check that E calls the function being compiled and record the binding
+ * used to reach it */
+static void
+check_self_call(Expr *e)
+{
+        Expr *name = EXPR(e->callexpr.name);
+        int depth, slot, cell;
+
+        if (name->type != LITEXPR || name->litexpr.token != IDENTIFIER)
+                bail();
+        if (strcmp(name->litexpr.str, cg.name)) bail();
+        if (e->callexpr.args.count != cg.arity) bail();
+
+        /* Only globals and the variables the function captured (after
+         * the parameters in the env of level 0) can be bound to it */
+        depth = name->litexpr.depth;
+        slot = name->litexpr.slot;
+        cell = depth != GLOBAL_DEPTH;
+        if (cell) {
+                if (depth != (CELL_DEPTH | (arrlen(cg.levels) - 1)) || slot < cg.arity)
+                        bail();
+                slot -= cg.arity;
+        }
+        if (cg.jit->has_self && (cg.jit->self_cell != cell || cg.jit->self_slot != slot))
+                bail();
+        cg.jit->has_self = 1;
+        cg.jit->self_cell = cell;
+        cg.jit->self_slot = slot;
+}
+
+static void gen_expr(Expr *e);
+
+/* Push every argument, leaving rdi pointing to the first one */
+static void
+gen_args(Expr *e)
+{
+        for (uint32_t i = 0; i < e->callexpr.args.count; i++) {
+                gen_expr(EXPR(LIST_AT(e->callexpr.args, i)));
+                emit(1, 0x50); // push rax
+        }
+}
+
+static void
+gen_call(Expr *e)
+{
+        check_self_call(e);
+        gen_args(e);
+        emit(4, 0x48, 0x8d, 0xbc, 0x24); // lea rdi, [rsp + disp32]
+        emit32(8 * (cg.arity - 1));
+        patch_to(emit_jump(1, 0xe8, 0), 0); // call <function start>
+        emit(3, 0x48, 0x81, 0xc4); // add rsp, imm32
+        emit32(8 * cg.arity);
+}
+
+static void
+gen_setcc(int cc)
+{
+        emit(3, 0x0f, cc, 0xc0); // setcc al
+        emit(3, 0x0f, 0xb6, 0xc0); // movzx eax, al
+}
+
+static void
+gen_binexpr(Expr *e)
+{
+        gen_expr(EXPR(e->binexpr.lhs));
+        emit(1, 0x50); // push rax
+        gen_expr(EXPR(e->binexpr.rhs));
+        emit(2, 0x89, 0xc1); // mov ecx, eax
+        emit(1, 0x58); // pop rax
+
+        switch (e->binexpr.op) {
+        case PLUS:
+                emit(2, 0x01, 0xc8); // add eax, ecx
+                break;
+        case MINUS:
+                emit(2, 0x29, 0xc8); // sub eax, ecx
+                break;
+        case STAR:
+                emit(3, 0x0f, 0xaf, 0xc1); // imul eax, ecx
+                break;
+        case SLASH:
+                emit(3, 0x99, 0xf7, 0xf9); // cdq; idiv ecx
+                break;
+        case BITWISE_AND:
+                emit(2, 0x21, 0xc8); // and eax, ecx
+                break;
+        case BITWISE_OR:
+                emit(2, 0x09, 0xc8); // or eax, ecx
+                break;
+        case BITWISE_XOR:
+                emit(2, 0x31, 0xc8); // xor eax, ecx
+                break;
+        case SHIFT_LEFT:
+                emit(2, 0xd3, 0xe0); // shl eax, cl
+                break;
+        case SHIFT_RIGHT:
+                emit(2, 0xd3, 0xf8); // sar eax, cl
+                break;
+        case EQUAL_EQUAL:
+                emit(2, 0x39, 0xc8); // cmp eax, ecx
+                gen_setcc(0x94);
+                break;
+        case BANG_EQUAL:
+                emit(2, 0x39, 0xc8);
+                gen_setcc(0x95);
+                break;
+        case GREATER:
+                emit(2, 0x39, 0xc8);
+                gen_setcc(0x9f);
+                break;
+        case GREATER_EQUAL:
+                emit(2, 0x39, 0xc8);
+                gen_setcc(0x9d);
+                break;
+        case LESS:
+                emit(2, 0x39, 0xc8);
+                gen_setcc(0x9c);
+                break;
+        case LESS_EQUAL:
+                emit(2, 0x39, 0xc8);
+                gen_setcc(0x9e);
+                break;
+        default:
+                bail();
+        }
+}
+
+static void
+gen_test()
+{
+        emit(2, 0x85, 0xc0); // test eax, eax
+}
+
+static void
+gen_expr(Expr *e)
+{
+        int index, end, lfalse, lfalse2;
+
+        switch (e->type) {
+        case LITEXPR:
+                switch (e->litexpr.token) {
+                case NUMBER:
+                        emit(1, 0xb8); // mov eax, imm32
+                        emit32(e->litexpr.num);
+                        break;
+                case TRUE:
+                case FALSE:
+                        emit(1, 0xb8);
+                        emit32(e->litexpr.token == TRUE);
+                        break;
+                case IDENTIFIER:
+                        index = local_index(e->litexpr.depth, e->litexpr.slot);
+                        if (index < 0) bail();
+                        load_local(index);
+                        break;
+                default:
+                        bail();
+                }
+                break;
+        case INCEXPR: // fused nodes keep the original one, see optimizer.c
+        case ASSIGNEXPR:
+                index = local_index(e->assignexpr.depth, e->assignexpr.slot);
+                if (index < 0) bail();
+                gen_expr(EXPR(e->assignexpr.value));
+                store_local(index);
+                break;
+        case CMPEXPR:
+        case BINEXPR_ADD_NUM:
+        case BINEXPR_SUB_NUM:
+        case BINEXPR_MUL_NUM:
+        case BINEXPR_DIV_NUM:
+        case BINEXPR_BAND_NUM:
+        case BINEXPR_BOR_NUM:
+        case BINEXPR_BXOR_NUM:
+        case BINEXPR_EQ_NUM:
+        case BINEXPR_NE_NUM:
+        case BINEXPR_GT_NUM:
+        case BINEXPR_GE_NUM:
+        case BINEXPR_LT_NUM:
+        case BINEXPR_LE_NUM:
+        case BINEXPR:
+                gen_binexpr(e);
+                break;
+        case UNEXPR:
+                gen_expr(EXPR(e->unexpr.rhs));
+                switch (e->unexpr.op) {
+                case MINUS:
+                        emit(2, 0xf7, 0xd8); // neg eax
+                        break;
+                case BITWISE_NOT:
+                        emit(2, 0xf7, 0xd0); // not eax
+                        break;
+                case BANG:
+                        gen_test();
+                        gen_setcc(0x94);
+                        break;
+                default:
+                        bail();
+                }
+                break;
+        case OREXPR:
+                /* lhs if true, else rhs if true, else 0: that is rhs */
+                gen_expr(EXPR(e->orexpr.lhs));
+                gen_test();
+                end = emit_jump(2, 0x0f, 0x85); // jne
+                gen_expr(EXPR(e->orexpr.rhs));
+                patch(end);
+                break;
+        case ANDEXPR:
+                gen_expr(EXPR(e->andexpr.lhs));
+                gen_test();
+                lfalse = emit_jump(2, 0x0f, 0x84); // je
+                gen_expr(EXPR(e->andexpr.rhs));
+                gen_test();
+                lfalse2 = emit_jump(2, 0x0f, 0x84);
+                emit(1, 0xb8);
+                emit32(1);
+                end = emit_jump(1, 0xe9, 0); // jmp
+                patch(lfalse);
+                patch(lfalse2);
+                emit(2, 0x31, 0xc0); // xor eax, eax
+                patch(end);
+                break;
+        case CALLEXPR:
+                gen_call(e);
+                break;
+        default:
+                bail();
+        }
+}
+
+static void
+gen_return()
+{
+        emit(3, 0x48, 0x89, 0xec); // mov rsp, rbp
+        emit(2, 0x5d, 0xc3); // pop rbp; ret
+}
+
+/* return f(...) to itself: overwrite the parameters and start again */
+static void
+gen_tail_call(Expr *e)
+{
+        check_self_call(e);
+        gen_args(e);
+        for (int i = cg.arity - 1; i >= 0; i--) {
+                emit(1, 0x58); // pop rax
+                store_local(cg.levels[0].base + i);
+        }
+        patch_to(emit_jump(1, 0xe9, 0), cg.body_start);
+}
+
+static void gen_stmt(Stmt *s);
+
+static void
+gen_stmt_list(NodeList l)
+{
+        for (uint32_t i = 0; i < l.count; i++)
+                gen_stmt(STMT(LIST_AT(l, i)));
+}
+
+static void
+gen_stmt(Stmt *s)
+{
+        int lelse, end, start;
+
+        switch (s->type) {
+        case EXPRSTMT:
+                gen_expr(EXPR(s->expr.body));
+                break;
+        case VARDECLSTMT:
+                gen_expr(EXPR(s->vardecl.value));
+                store_local(local_index(0, s->vardecl.slot));
+                break;
+        case BLOCKSTMT:
+                level_push(s->block.size);
+                gen_stmt_list(s->block.body);
+                level_pop();
+                break;
+        case IFSTMT:
+                gen_expr(EXPR(s->ifstmt.cond));
+                gen_test();
+                lelse = emit_jump(2, 0x0f, 0x84); // je
+                gen_stmt(STMT(s->ifstmt.body));
+                if (s->ifstmt.elsebody) {
+                        end = emit_jump(1, 0xe9, 0);
+                        patch(lelse);
+                        gen_stmt(STMT(s->ifstmt.elsebody));
+                        patch(end);
+                } else
+                        patch(lelse);
+                break;
+        case WHILESTMT:
+                start = here();
+                gen_expr(EXPR(s->whilestmt.cond));
+                gen_test();
+                end = emit_jump(2, 0x0f, 0x84);
+                gen_stmt(STMT(s->whilestmt.body));
+                patch_to(emit_jump(1, 0xe9, 0), start);
+                patch(end);
+                break;
+        case RETSTMT:
+                if (s->retstmt.tail) {
+                        gen_tail_call(EXPR(s->retstmt.value));
+                        break;
+                }
+                gen_expr(EXPR(s->retstmt.value));
+                gen_return();
+                break;
+        default:
+                bail();
+        }
+}
+
+static int
+always_returns(Stmt *s)
+{
+        switch (s->type) {
+        case RETSTMT:
+                return 1;
+        case BLOCKSTMT:
+                for (uint32_t i = 0; i < s->block.body.count; i++)
+                        if (always_returns(STMT(LIST_AT(s->block.body, i)))) return 1;
+                return 0;
+        case IFSTMT:
+                return s->ifstmt.elsebody && always_returns(STMT(s->ifstmt.body)) &&
+                       always_returns(STMT(s->ifstmt.elsebody));
+        default:
+                return 0;
+        }
+}
+
+static JitFn
+install(uint8_t *code, int size)
+{
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return NULL;
+        memcpy(mem, code, size);
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+                munmap(mem, size);
+                return NULL;
+        }
+        return (JitFn) mem;
+}
+
+/* Called when the unit of the function body is freed */
+static void
+jit_free(void *p)
+{
+        Jit *j = p;
+        if (j->code) munmap((void *) j->code, j->size);
+        free(j);
+}
+
+static Jit *
+jit_compile(Value func, int argc)
+{
+        Jit *j = calloc(1, sizeof(Jit));
+        Stmt *body = func.fn->body;
+        int frame_at;
+
+        unit_on_free(body, jit_free, j);
+
+        if (!always_returns(body)) return j;
+
+        memset(&cg, 0, sizeof cg);
+        cg.arity = argc;
+        cg.name = func.fn->name;
+        cg.jit = j;
+
+        if (setjmp(jit_bail)) {
+                arrfree(cg.code);
+                arrfree(cg.levels);
+                j->has_self = 0;
+                return j;
+        }
+
+        emit(1, 0x55); // push rbp
+        emit(3, 0x48, 0x89, 0xe5); // mov rbp, rsp
+        emit(3, 0x48, 0x81, 0xec); // sub rsp, imm32
+        frame_at = here();
+        emit32(0);
+
+        level_push(argc);
+        for (int i = 0; i < argc; i++) {
+                emit(3, 0x48, 0x8b, 0x87); // mov rax, [rdi + disp32]
+                emit32(-8 * i);
+                store_local(i);
+        }
+        cg.body_start = here();
+        gen_stmt(body);
+        level_pop();
+
+        int32_t frame = (cg.nlocals * 8 + 15) & ~15;
+        memcpy(cg.code + frame_at, &frame, 4);
+
+        j->code = install(cg.code, here());
+        j->size = here();
+        arrfree(cg.code);
+        arrfree(cg.levels);
+        return j;
+}
+
+/* Value bound to the name used for self calls by function F */
+static Value
+self_binding(Jit *j, Function *f)
+{
+        if (j->self_cell) return f->cells[j->self_slot]->value;
+        return global_env->slots[j->self_slot];
+}
+
+int
+jit_call(Value func, Value *argv, int argc, Value *ret)
+{
+        Stmt *body = func.fn->body;
+        Jit *j = body->block.jit;
+        long args[argc + 1];
+        Value self;
+
+        if (!jit_enabled) return 0;
+        if (!j) j = body->block.jit = jit_compile(func, argc);
+        if (!j->code) return 0;
+
+        for (int i = 0; i < argc; i++) {
+                if (argv[i].type != TYPE_NUM) return 0;
+                args[argc - 1 - i] = argv[i].num;
+        }
+
+        if (j->has_self) {
+                self = self_binding(j, func.fn);
+                if (self.type != TYPE_CALLABLE || self.fn->body != body)
+                        return 0;
+        }
+
+        ret->type = TYPE_NUM;
+        ret->num = (int) j->code(argc ? args + argc - 1 : args);
+        return 1;
+}
+
+#else
+
+int
+jit_call(Value func, Value *argv, int argc, Value *ret)
+{
+        return 0;
+}
+
+#endif
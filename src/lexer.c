@@ -6,39 +6,207 @@
  * */
 
 #include <assert.h>
-#include <ctype.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__) && defined(__SSE2__)
+#include <immintrin.h>
+#define LEX_SIMD
+#endif
+
+#include "str.h"
 #include "tokens.h"
+#include "unit.h"
+
+#include "stb_ds.h"
 
 /* Location of current char in file buffer */
 char *current_ptr = NULL;
+static char *source;
 /* Location of current token in source */
-char *start_line;
 char *start_offset;
 int line = 1;
-/* First token of token list */
-vtok *head_token = NULL;
+
+Tokens tokens;
+static uint32_t capacity = 0;
+
+/* Classes of each char, so scanning a name is a load and a test per
+ * char. EOF (as a char) and 0 end the source and are in no class */
+enum {
+        CC_WORD_START = 1, // letters and _
+        CC_WORD = 2, // letters, digits and _
+        CC_SPACE = 4,
+};
+
+static const uint8_t char_class[256] = {
+        ['a' ... 'z'] = CC_WORD_START | CC_WORD,
+        ['A' ... 'Z'] = CC_WORD_START | CC_WORD,
+        ['_'] = CC_WORD_START | CC_WORD,
+        ['0' ... '9'] = CC_WORD,
+        [' '] = CC_SPACE,
+        ['\t'] = CC_SPACE,
+        ['\n'] = CC_SPACE,
+        ['\v'] = CC_SPACE,
+        ['\f'] = CC_SPACE,
+        ['\r'] = CC_SPACE,
+};
+
+/* Long runs of chars (comments, string literals, indentation and names)
+ * are scanned 32 or 16 chars at a time when the CPU can, picked when the
+ * program starts. Loads may read up to 31 chars past the 0 that ends
+ * the source, so sources are followed by LEX_PAD readable bytes. Each
+ * scanner returns the first char from P that ends the run:
+ * - until: one of A, B, C or D, one of which has to be 0.
+ * - blanks: not a space, tab or carriage return.
+ * - word: not a letter, digit or _. */
+typedef struct Scanner {
+        char *(*until)(char *p, char a, char b, char c, char d);
+        char *(*blanks)(char *p);
+        char *(*word)(char *p);
+} Scanner;
+
+static char *
+until_scalar(char *p, char a, char b, char c, char d)
+{
+        while (*p != a && *p != b && *p != c && *p != d)
+                ++p;
+        return p;
+}
+
+static char *
+blanks_scalar(char *p)
+{
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+                ++p;
+        return p;
+}
+
+static char *
+word_scalar(char *p)
+{
+        while (char_class[(unsigned char) *p] & CC_WORD)
+                ++p;
+        return p;
+}
+
+static const char *scanner_name = "scalar";
+static Scanner scan = { until_scalar, blanks_scalar, word_scalar };
+
+#ifdef LEX_SIMD
+/* The same scanners for vectors V of N chars. Chars of a name are found
+ * with signed compares, as all of them are below 128: letters by
+ * setting the lowercase bit first, then digits and _ */
+#define VECTOR_SCANNERS(isa, V, N, TARGET, LOAD, SET1, EQ, GT, OR, AND, MOVEMASK)   \
+        TARGET static char *                                                        \
+        until_##isa(char *p, char a, char b, char c, char d)                        \
+        {                                                                           \
+                V va = SET1(a), vb = SET1(b), vc = SET1(c), vd = SET1(d);           \
+                V x;                                                                \
+                unsigned m;                                                         \
+                for (;; p += N) {                                                   \
+                        x = LOAD((V *) p);                                          \
+                        m = MOVEMASK(OR(OR(EQ(x, va), EQ(x, vb)),                   \
+                                        OR(EQ(x, vc), EQ(x, vd))));                 \
+                        if (m) return p + __builtin_ctz(m);                         \
+                }                                                                   \
+        }                                                                           \
+                                                                                    \
+        TARGET static char *                                                        \
+        blanks_##isa(char *p)                                                       \
+        {                                                                           \
+                V sp = SET1(' '), tab = SET1('\t'), cr = SET1('\r');                \
+                V x;                                                                \
+                unsigned m;                                                         \
+                for (;; p += N) {                                                   \
+                        x = LOAD((V *) p);                                          \
+                        m = MOVEMASK(OR(OR(EQ(x, sp), EQ(x, tab)), EQ(x, cr)));     \
+                        m = ~m & (unsigned) ((1ull << N) - 1);                      \
+                        if (m) return p + __builtin_ctz(m);                         \
+                }                                                                   \
+        }                                                                           \
+                                                                                    \
+        TARGET static char *                                                        \
+        word_##isa(char *p)                                                         \
+        {                                                                           \
+                V lower = SET1(0x20), under = SET1('_');                            \
+                V a = SET1('a' - 1), z = SET1('z' + 1);                             \
+                V d0 = SET1('0' - 1), d9 = SET1('9' + 1);                           \
+                V x, l;                                                             \
+                unsigned m;                                                         \
+                for (;; p += N) {                                                   \
+                        x = LOAD((V *) p);                                          \
+                        l = OR(x, lower);                                           \
+                        m = MOVEMASK(OR(OR(AND(GT(l, a), GT(z, l)),                 \
+                                           AND(GT(x, d0), GT(d9, x))),              \
+                                        EQ(x, under)));                             \
+                        m = ~m & (unsigned) ((1ull << N) - 1);                      \
+                        if (m) return p + __builtin_ctz(m);                         \
+                }                                                                   \
+        }
+
+VECTOR_SCANNERS(sse2, __m128i, 16, __attribute__((target("sse2"))),
+                _mm_loadu_si128, _mm_set1_epi8, _mm_cmpeq_epi8, _mm_cmpgt_epi8,
+                _mm_or_si128, _mm_and_si128, _mm_movemask_epi8)
+
+VECTOR_SCANNERS(avx2, __m256i, 32, __attribute__((target("avx2"))),
+                _mm256_loadu_si256, _mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_cmpgt_epi8,
+                _mm256_or_si256, _mm256_and_si256, _mm256_movemask_epi8)
+
+static __attribute__((constructor)) void
+__init__()
+{
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                scan = (Scanner) { until_avx2, blanks_avx2, word_avx2 };
+                scanner_name = "avx2";
+        } else if (__builtin_cpu_supports("sse2")) {
+                scan = (Scanner) { until_sse2, blanks_sse2, word_sse2 };
+                scanner_name = "sse2";
+        }
+}
+#endif
+
+/* Most names and indentation are short, so their first chars are checked
+ * here before handing the run to the scanner */
+#define SHORT_RUN 8
+
+static inline char *
+skip_word(char *p)
+{
+        for (int i = 0; i < SHORT_RUN; i++, p++)
+                if (!(char_class[(unsigned char) *p] & CC_WORD)) return p;
+        return scan.word(p);
+}
+
+static inline char *
+skip_blanks(char *p)
+{
+        for (int i = 0; i < SHORT_RUN; i++, p++)
+                if (*p != ' ' && *p != '\t' && *p != '\r') return p;
+        return scan.blanks(p);
+}
 
 
 void
-print_literal(vtok *tok)
+print_literal(TokRef t)
 {
-        switch (tok->token) {
+        switch (TOK_KIND(t)) {
         case STRING:
-                printf(" \"%s\"", tok->str_literal);
+                printf(" \"%s\"", TOK_STR(t));
                 break;
         case IDENTIFIER:
-                printf(" `%s`", tok->str_literal);
+                printf(" `%s`", TOK_STR(t));
                 break;
         case NUMBER:
-                printf(" `%d`", tok->num_literal);
+                printf(" `%d`", TOK_NUM(t));
                 break;
         case TRUE:
                 printf(" `true`");
@@ -52,15 +220,18 @@ print_literal(vtok *tok)
 }
 
 void
-print_token(vtok *tok)
+print_token(TokRef t)
 {
-        printf("[%2d:%2ld] Token: %s", tok->line, tok->offset, TOKEN_REPR[tok->token]);
-        if (tok->token == STRING ||
-            tok->token == IDENTIFIER ||
-            tok->token == NUMBER ||
-            tok->token == TRUE ||
-            tok->token == FALSE) {
-                print_literal(tok);
+        int line, column;
+
+        tok_position(t, &line, &column);
+        printf("[%2d:%2d] Token: %s", line, column, TOKEN_REPR[TOK_KIND(t)]);
+        if (TOK_KIND(t) == STRING ||
+            TOK_KIND(t) == IDENTIFIER ||
+            TOK_KIND(t) == NUMBER ||
+            TOK_KIND(t) == TRUE ||
+            TOK_KIND(t) == FALSE) {
+                print_literal(t);
         }
         printf("\n");
 }
@@ -68,56 +239,68 @@ print_token(vtok *tok)
 void
 print_tokens()
 {
-        vtok *tok = head_token;
-        while (tok) {
-                print_token(tok);
-                tok = tok->next;
-        }
+        for (TokRef t = 1; t < tokens.count; t++)
+                print_token(t);
 }
 
 void
-free_tokens()
+tok_position(TokRef t, int *line, int *column)
 {
-        vtok *current = head_token;
-        while (current) {
-                vtok *next = current->next;
-                free(current);
-                current = next;
+        int lo = 0;
+        int hi = arrlen(tokens.lines) - 1;
+        int mid;
+
+        /* Last line that starts before the token */
+        while (lo < hi) {
+                mid = (lo + hi + 1) / 2;
+                if (tokens.lines[mid] <= tokens.pos[t])
+                        lo = mid;
+                else
+                        hi = mid - 1;
         }
+        *line = tokens.first_line + lo;
+        *column = tokens.pos[t] - tokens.lines[lo] + 1;
 }
 
-static vtok *
+static void
+grow()
+{
+        capacity = capacity ? capacity * 2 : 1024;
+        tokens.kind = realloc(tokens.kind, capacity * sizeof *tokens.kind);
+        tokens.literal = realloc(tokens.literal, capacity * sizeof *tokens.literal);
+        tokens.pos = realloc(tokens.pos, capacity * sizeof *tokens.pos);
+        if (!tokens.kind || !tokens.literal || !tokens.pos) {
+                report("Out of memory for tokens\n");
+                exit(1);
+        }
+}
+
+static TokRef
 new_token(vtoktype token)
 {
-        vtok *tok = malloc(sizeof *tok);
-        tok->line = line;
-        tok->token = token;
-        tok->lexeme = TOKEN_REPR[token];
-        tok->offset = start_offset - start_line + 1;
-        /* Link token */
-        static vtok *prev = NULL;
-        tok->next = NULL;
-        if (prev) prev->next = tok;
-        prev = tok;
-
-        if (head_token == NULL) head_token = tok;
-        return tok;
+        TokRef t;
+
+        if (tokens.count >= capacity) grow();
+        t = tokens.count++;
+        tokens.kind[t] = token;
+        tokens.pos[t] = start_offset - source;
+        return t;
 }
 
 void
-add_literal_value(vtok *tok, ...)
+add_literal_value(TokRef t, ...)
 {
         va_list v;
-        va_start(v, tok);
-        switch (tok->token) {
+        va_start(v, t);
+        switch (TOK_KIND(t)) {
         case STRING:
-                tok->str_literal = va_arg(v, char *);
+                TOK_STR(t) = va_arg(v, char *);
                 break;
         case IDENTIFIER:
-                tok->str_literal = va_arg(v, char *);
+                TOK_STR(t) = va_arg(v, char *);
                 break;
         case NUMBER:
-                tok->num_literal = va_arg(v, int);
+                TOK_NUM(t) = va_arg(v, int);
                 break;
         default:
                 break;
@@ -125,21 +308,12 @@ add_literal_value(vtok *tok, ...)
         va_end(v);
 }
 
-#define add_token(token, ...)                          \
-        do {                                           \
-                vtok *tok = new_token(token);          \
-                add_literal_value(tok, ##__VA_ARGS__); \
+#define add_token(token, ...)                        \
+        do {                                         \
+                TokRef t = new_token(token);         \
+                add_literal_value(t, ##__VA_ARGS__); \
         } while (0)
 
-static bool
-match_word(const char *restrict word)
-{
-        int len = strlen(word);
-        if (memcmp(word, current_ptr - 1, len)) return false;
-        current_ptr += len - 1;
-        return true;
-}
-
 static bool
 match(char expected)
 {
@@ -154,37 +328,96 @@ get_consume_lex()
         return *current_ptr++;
 }
 
+/* Chars up to the closing quote, with escapes expanded, interned. Only
+ * strings with escapes are copied before interning them */
 static char *
 get_string()
 {
-        char *ret = current_ptr;
-        char tmp;
+        static const char escape_lookup[] = {
+                ['a'] = '\a',
+                ['b'] = '\b',
+                ['t'] = '\t',
+                ['n'] = '\n',
+                ['v'] = '\v',
+                ['f'] = '\f',
+                ['r'] = '\r',
+        };
+        char *start = current_ptr;
+        char *end, *buf;
+        bool escapes = false;
+        size_t n = 0;
+        Str *s;
 
-        do {
-                tmp = get_consume_lex();
-        } while (tmp != '"');
+        for (;;) {
+                current_ptr = scan.until(current_ptr, '"', '\\', 0, EOF);
+                if (*current_ptr == '"') break;
+                if (*current_ptr != '\\') {
+                        report("[line %d] Unterminated string\n", line);
+                        break;
+                }
+                escapes = true;
+                ++current_ptr;
+        }
+        end = current_ptr;
+        if (*current_ptr == '"') ++current_ptr;
+
+        if (!escapes) return str_intern(start, end - start)->chars;
 
-        current_ptr[-1] = 0;
-        ret = strdup(ret);
-        current_ptr[-1] = tmp;
-        return ret;
+        buf = malloc(end - start + 1);
+        for (char *c = start; c < end; c++) {
+                if (*c != '\\') {
+                        buf[n++] = *c;
+                        continue;
+                }
+                if (++c == end) break;
+                if ((unsigned char) *c < sizeof escape_lookup && escape_lookup[(unsigned char) *c])
+                        buf[n++] = escape_lookup[(unsigned char) *c];
+                else
+                        buf[n++] = *c;
+        }
+        s = str_intern(buf, n);
+        free(buf);
+        return s->chars;
 }
 
-static char *
-get_identifier()
+/* Names are told from keywords with a perfect hash of their first and
+ * last chars: no two keywords share a slot, so a name is a keyword only
+ * if it is the one in its slot */
+#define KEYWORD_SLOT(first, last) (((unsigned char) (first) + (unsigned char) (last)) & 31)
+
+static const struct {
+        const char *text;
+        int len;
+        vtoktype token;
+} keywords[32] = {
+        [KEYWORD_SLOT('e', 'e')] = { "else", 4, ELSE },
+        [KEYWORD_SLOT('f', 'e')] = { "false", 5, FALSE },
+        [KEYWORD_SLOT('f', 'c')] = { "func", 4, FUNCTION },
+        [KEYWORD_SLOT('v', 'r')] = { "var", 3, VAR },
+        [KEYWORD_SLOT('f', 'r')] = { "for", 3, FOR },
+        [KEYWORD_SLOT('i', 'f')] = { "if", 2, IF },
+        [KEYWORD_SLOT('n', 'l')] = { "nil", 3, NIL },
+        [KEYWORD_SLOT('e', 'n')] = { "extern", 6, EXTERN },
+        [KEYWORD_SLOT('r', 'n')] = { "return", 6, RETURN },
+        [KEYWORD_SLOT('t', 'e')] = { "true", 4, TRUE },
+        [KEYWORD_SLOT('w', 'e')] = { "while", 5, WHILE },
+        [KEYWORD_SLOT('a', 't')] = { "assert", 6, ASSERT },
+};
+
+/* Keyword or name that starts at the char before current_ptr */
+static void
+get_word()
 {
-        char *ret = current_ptr - 1;
-        char tmp;
-
-        do {
-                tmp = get_consume_lex();
-        } while (isalnum(tmp) || tmp == '_');
-
-        current_ptr[-1] = 0;
-        ret = strdup(ret);
-        current_ptr[-1] = tmp;
-        --current_ptr;
-        return ret;
+        char *start = current_ptr - 1;
+        int len, k;
+
+        current_ptr = skip_word(current_ptr);
+        len = current_ptr - start;
+        k = KEYWORD_SLOT(start[0], start[len - 1]);
+        if (keywords[k].len == len && !memcmp(keywords[k].text, start, len))
+                add_token(keywords[k].token);
+        else
+                add_token(IDENTIFIER, str_intern(start, len)->chars);
 }
 
 static int
@@ -202,21 +435,18 @@ get_number()
 static void
 get_comment()
 {
-        for (;;) {
-                if (*current_ptr == '\n' ||
-                    *current_ptr == EOF ||
-                    *current_ptr == 0) break;
-                ++current_ptr;
-        }
+        current_ptr = scan.until(current_ptr, '\n', EOF, 0, 0);
 }
 
 void
-lex_analize(char *source)
+lex_analize(char *text)
 {
         char current;
-        head_token = NULL;
-        current_ptr = source;
-        start_line = current_ptr;
+        source = current_ptr = text;
+        tokens.count = 1;
+        tokens.first_line = line;
+        arrsetlen(tokens.lines, 0);
+        arrput(tokens.lines, 0);
         for (;;) {
                 start_offset = current_ptr;
                 switch (current = get_consume_lex()) {
@@ -303,7 +533,7 @@ lex_analize(char *source)
 
                 case '>':
                         if (match('>'))
-                                add_token(SHIFT_LEFT);
+                                add_token(SHIFT_RIGHT);
                         else if (match('='))
                                 add_token(GREATER_EQUAL);
                         else
@@ -311,7 +541,7 @@ lex_analize(char *source)
                         break;
                 case '<':
                         if (match('<'))
-                                add_token(SHIFT_RIGHT);
+                                add_token(SHIFT_LEFT);
                         else if (match('='))
                                 add_token(LESS_EQUAL);
                         else
@@ -326,8 +556,13 @@ lex_analize(char *source)
                         add_token(NUMBER, get_number());
                         break;
 
+                case ' ':
+                case '\t':
+                case '\r':
+                        current_ptr = skip_blanks(current_ptr);
+                        break;
                 case '\n':
-                        start_line = current_ptr;
+                        arrput(tokens.lines, current_ptr - source);
                         ++line;
                         break;
                 case 0:
@@ -336,44 +571,139 @@ lex_analize(char *source)
                         break;
 
                 default:
-                        if (isspace(current)) break;
-                        if (!isalpha(current) && current != '_') {
+                        if (char_class[(unsigned char) current] & CC_SPACE) break;
+                        if (!(char_class[(unsigned char) current] & CC_WORD_START)) {
                                 report("[line %d] Invalid lexeme: `%c`\n",
                                        line, current);
                                 add_token(UNKNOWN);
                                 break;
                         }
-
-                        else if (match_word("else"))
-                                add_token(ELSE);
-                        else if (match_word("false"))
-                                add_token(FALSE);
-                        else if (match_word("func"))
-                                add_token(FUNCTION);
-                        else if (match_word("var"))
-                                add_token(VAR);
-                        else if (match_word("for"))
-                                add_token(FOR);
-                        else if (match_word("if"))
-                                add_token(IF);
-                        else if (match_word("nil"))
-                                add_token(NIL);
-                        else if (match_word("extern"))
-                                add_token(EXTERN);
-                        else if (match_word("return"))
-                                add_token(RETURN);
-                        else if (match_word("true"))
-                                add_token(TRUE);
-                        else if (match_word("while"))
-                                add_token(WHILE);
-                        else if (match_word("assert"))
-                                add_token(ASSERT);
-                        else
-                                add_token(IDENTIFIER, get_identifier());
-
+                        get_word();
                         break;
                 }
 
                 if (current == EOF || current == 0) break;
         }
 }
+
+/* A file is lexed from a private mapping of it, followed by at least a
+ * page of zeros that ends the source, so reading a few chars past the
+ * end is safe. It is kept until the unit of the file is freed. Files
+ * that can not be mapped, as pipes, are read into memory instead */
+typedef struct Source {
+        char *text;
+        size_t size; // of the mapping, or 0 if malloc'd
+} Source;
+
+static void
+source_free(void *p)
+{
+        Source *src = p;
+        if (src->size)
+                munmap(src->text, src->size);
+        else
+                free(src->text);
+}
+
+static char *
+read_all(int fd, size_t *len)
+{
+        size_t cap = 64 * 1024;
+        char *text = malloc(cap);
+        char *grown;
+        ssize_t n;
+
+        *len = 0;
+        if (!text) {
+                report("Out of memory\n");
+                return NULL;
+        }
+        while ((n = read(fd, text + *len, cap - *len - LEX_PAD)) > 0) {
+                *len += n;
+                if (*len + LEX_PAD < cap) continue;
+                if (!(grown = realloc(text, cap * 2))) {
+                        report("Out of memory\n");
+                        free(text);
+                        return NULL;
+                }
+                text = grown;
+                cap *= 2;
+        }
+        if (n < 0) {
+                free(text);
+                return NULL;
+        }
+        text[*len] = 0;
+        return text;
+}
+
+static char *
+map_file(int fd, size_t *len, size_t *size)
+{
+        size_t page = sysconf(_SC_PAGESIZE);
+        struct stat st;
+        char *text;
+
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return NULL;
+        *len = st.st_size;
+        *size = ((*len + page - 1) & ~(page - 1)) + page;
+        text = mmap(NULL, *size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (text == MAP_FAILED) return NULL;
+        if (*len > 0 &&
+            mmap(text, *len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                munmap(text, *size);
+                return NULL;
+        }
+        return text;
+}
+
+ssize_t
+lex_file(const char *filename)
+{
+        Source *src;
+        size_t len, size;
+        char *text;
+        int fd;
+
+        if ((fd = open(filename, O_RDONLY)) < 0) return -1;
+        unit_begin();
+        if (!(text = map_file(fd, &len, &size))) {
+                size = 0;
+                text = read_all(fd, &len);
+        }
+        close(fd);
+        if (!text) return -1;
+
+        lex_analize(text);
+        src = unit_alloc(sizeof *src);
+        src->text = text;
+        src->size = size;
+        unit_on_free(src, source_free, src);
+        return len;
+}
+
+/* --lex-bench: lex FILENAME again and again for about a second, and
+ * print how many bytes of source were lexed per second */
+int
+lex_bench(const char *filename)
+{
+        struct timespec t0, t1;
+        double secs;
+        long rounds = 0;
+        ssize_t len;
+        char *text;
+
+        if ((len = lex_file(filename)) < 0) return -1;
+        text = source;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        do {
+                for (int i = 0; i < 64; i++)
+                        lex_analize(text);
+                rounds += 64;
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        } while (secs < 1.0);
+        fprintf(stderr, "lex (%s): %zd bytes x %ld in %.2f s: %.1f MB/s, %u tokens\n",
+                scanner_name, len, rounds, secs, len * rounds / secs / 1e6, tokens.count - 1);
+        return 0;
+}
@@ -0,0 +1,298 @@
+/* VISPEL interpreter - Fuse common patterns of the resolved AST
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+#include "interpreter.h"
+#include "tokens.h"
+
+/* Operations on number literals are folded into a literal. Fused nodes
+ * overlay the node they replace, so eval() can fall back to the original
+ * one if the fast path does not apply:
+ * - INCEXPR: ID = ID + NUM, ID = ID - NUM (ID++ and ID-- too)
+ * - CMPEXPR: ID op NUM, for comparison operators
+ * - GETEXPR: get(list, index), if `get` is the one from the core lib
+ *
+ * eval() runs it on functions and loops once they are hot, so it can be
+ * called while outer frames are evaluating the same code, even the node
+ * being rewritten (a recursive call inside get(l, f(n - 1))). That is
+ * safe because fused nodes keep the layout of the node they replace: a
+ * frame that is evaluating it still finds its operands where they were.
+ * Only folding drops operands, and it only folds number literals, which
+ * can not be in the middle of being evaluated. */
+
+/* Nodes rewritten so far, printed by --opt-stats */
+int opt_stats = 0;
+static struct {
+        int folded;
+        int incexpr;
+        int cmpexpr;
+        int getexpr;
+} stats;
+
+static int
+is_var(Expr *e)
+{
+        return e->type == LITEXPR && e->litexpr.token == IDENTIFIER;
+}
+
+static int
+is_num(Expr *e)
+{
+        return e->type == LITEXPR && e->litexpr.token == NUMBER;
+}
+
+/* Replace E by a number literal with value N */
+static void
+set_num(Expr *e, int n)
+{
+        e->type = LITEXPR;
+        e->litexpr.token = NUMBER;
+        e->litexpr.num = n;
+        e->litexpr.depth = 0;
+        e->litexpr.slot = 0;
+}
+
+static int
+fold_binexpr(Expr *e)
+{
+        Expr *lhs = EXPR(e->binexpr.lhs);
+        Expr *rhs = EXPR(e->binexpr.rhs);
+        vtoktype op = e->binexpr.op;
+        Value v;
+
+        if (!is_num(lhs) || !is_num(rhs)) return 0;
+        switch (op) {
+        case SLASH:
+                if (rhs->litexpr.num == 0) return 0;
+                break;
+        case PLUS:
+        case MINUS:
+        case STAR:
+        case BITWISE_AND:
+        case BITWISE_OR:
+        case BITWISE_XOR:
+        case SHIFT_LEFT:
+        case SHIFT_RIGHT:
+        case EQUAL_EQUAL:
+        case BANG_EQUAL:
+        case GREATER:
+        case GREATER_EQUAL:
+        case LESS:
+        case LESS_EQUAL:
+                break;
+        default:
+                return 0;
+        }
+        v = eval_binop(op,
+                       (Value) { .type = TYPE_NUM, .num = lhs->litexpr.num },
+                       (Value) { .type = TYPE_NUM, .num = rhs->litexpr.num });
+        set_num(e, v.num);
+        ++stats.folded;
+        return 1;
+}
+
+static void
+fold_unexpr(Expr *e)
+{
+        Expr *rhs = EXPR(e->unexpr.rhs);
+
+        if (!is_num(rhs)) return;
+        switch (e->unexpr.op) {
+        case MINUS:
+                set_num(e, -rhs->litexpr.num);
+                break;
+        case BANG:
+                set_num(e, !rhs->litexpr.num);
+                break;
+        case BITWISE_NOT:
+                set_num(e, ~rhs->litexpr.num);
+                break;
+        default:
+                return;
+        }
+        ++stats.folded;
+}
+
+static void
+fuse_assignexpr(Expr *e)
+{
+        Expr *v = EXPR(e->assignexpr.value);
+        Expr *lhs, *rhs;
+        int k;
+
+        if (v->type != BINEXPR) return;
+        lhs = EXPR(v->binexpr.lhs);
+        rhs = EXPR(v->binexpr.rhs);
+        if (!is_var(lhs) || !is_num(rhs)) return;
+        if (lhs->litexpr.depth != e->assignexpr.depth ||
+            lhs->litexpr.slot != e->assignexpr.slot)
+                return;
+
+        k = rhs->litexpr.num;
+        switch (v->binexpr.op) {
+        case PLUS:
+                break;
+        case MINUS:
+                k = -k;
+                break;
+        default:
+                return;
+        }
+        e->incexpr.k = k;
+        e->type = INCEXPR;
+        ++stats.incexpr;
+}
+
+static void
+fuse_binexpr(Expr *e)
+{
+        Expr *lhs = EXPR(e->binexpr.lhs);
+        Expr *rhs = EXPR(e->binexpr.rhs);
+
+        switch (e->binexpr.op) {
+        case EQUAL_EQUAL:
+        case BANG_EQUAL:
+        case GREATER:
+        case GREATER_EQUAL:
+        case LESS:
+        case LESS_EQUAL:
+                break;
+        default:
+                return;
+        }
+        if (!is_var(lhs) || !is_num(rhs)) return;
+
+        e->cmpexpr.depth = lhs->litexpr.depth;
+        e->cmpexpr.slot = lhs->litexpr.slot;
+        e->cmpexpr.k = rhs->litexpr.num;
+        e->type = CMPEXPR;
+        ++stats.cmpexpr;
+}
+
+static void
+fuse_callexpr(Expr *e)
+{
+        Expr *name = EXPR(e->callexpr.name);
+        if (e->callexpr.args.count != 2 || !is_var(name)) return;
+        if (name->litexpr.depth != GLOBAL_DEPTH) return;
+        if (strcmp(name->litexpr.str, "get")) return;
+        e->type = GETEXPR;
+        ++stats.getexpr;
+}
+
+static void optimize_expr(Expr *e);
+
+static void
+optimize_expr_list(NodeList l)
+{
+        for (uint32_t i = 0; i < l.count; i++)
+                optimize_expr(EXPR(LIST_AT(l, i)));
+}
+
+static void
+optimize_expr(Expr *e)
+{
+        switch (e->type) {
+        case ASSIGNEXPR:
+                optimize_expr(EXPR(e->assignexpr.value));
+                fuse_assignexpr(e);
+                break;
+        case BINEXPR_ADD_NUM ... BINEXPR_LE_NUM:
+                /* Specialized by eval() the first time it was run. Back
+                 * to generic, it is specialized again if it is not
+                 * folded or fused */
+                e->type = BINEXPR;
+                /* fall through */
+        case BINEXPR:
+                optimize_expr(EXPR(e->binexpr.lhs));
+                optimize_expr(EXPR(e->binexpr.rhs));
+                if (!fold_binexpr(e)) fuse_binexpr(e);
+                break;
+        case UNEXPR:
+                optimize_expr(EXPR(e->unexpr.rhs));
+                fold_unexpr(e);
+                break;
+        case CALLEXPR:
+                optimize_expr(EXPR(e->callexpr.name));
+                optimize_expr_list(e->callexpr.args);
+                fuse_callexpr(e);
+                break;
+        case OREXPR:
+                optimize_expr(EXPR(e->orexpr.lhs));
+                optimize_expr(EXPR(e->orexpr.rhs));
+                break;
+        case ANDEXPR:
+                optimize_expr(EXPR(e->andexpr.lhs));
+                optimize_expr(EXPR(e->andexpr.rhs));
+                break;
+        default:
+                break;
+        }
+}
+
+static void optimize_stmt(Stmt *s);
+
+static void
+optimize_stmt_list(NodeList l)
+{
+        for (uint32_t i = 0; i < l.count; i++)
+                optimize_stmt(STMT(LIST_AT(l, i)));
+}
+
+static void
+optimize_stmt(Stmt *s)
+{
+        switch (s->type) {
+        case VARDECLSTMT:
+                optimize_expr(EXPR(s->vardecl.value));
+                break;
+        case FUNDECLSTMT:
+                /* Nested functions are optimized when they get hot */
+                break;
+        case BLOCKSTMT:
+                optimize_stmt_list(s->block.body);
+                break;
+        case EXPRSTMT:
+                optimize_expr(EXPR(s->expr.body));
+                break;
+        case ASSERTSTMT:
+                optimize_expr(EXPR(s->assert.body));
+                break;
+        case IFSTMT:
+                optimize_expr(EXPR(s->ifstmt.cond));
+                optimize_stmt(STMT(s->ifstmt.body));
+                if (s->ifstmt.elsebody)
+                        optimize_stmt(STMT(s->ifstmt.elsebody));
+                break;
+        case WHILESTMT:
+                optimize_expr(EXPR(s->whilestmt.cond));
+                optimize_stmt(STMT(s->whilestmt.body));
+                break;
+        case RETSTMT:
+                optimize_expr(EXPR(s->retstmt.value));
+                break;
+        default:
+                break;
+        }
+}
+
+void
+optimize(Stmt *s)
+{
+        optimize_stmt(s);
+}
+
+void
+optimize_print_stats()
+{
+        fprintf(stderr, "opt: %d folded, %d incexpr, %d cmpexpr, %d getexpr\n",
+                stats.folded, stats.incexpr, stats.cmpexpr, stats.getexpr);
+}
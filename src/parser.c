@@ -15,12 +15,21 @@
 
 #include "env.h"
 #include "interpreter.h"
+#include "str.h"
 #include "tokens.h"
+#include "unit.h"
 
-vtok *current_token = NULL;
-Stmt *head_stmt = NULL;
+#include "stb_ds.h"
+
+TokRef current_token = 0;
+NodeList ast_program;
 jmp_buf panik_jmp;
 
+/* Nodes of the lists being parsed. Each list pushes its nodes over the
+ * ones of the lists that contain it, and moves them to ast_lists once it
+ * is complete. */
+static NodeRef *pending = NULL;
+
 static inline void
 panik_exit()
 {
@@ -36,66 +45,84 @@ print_ast_expr_branch(Expr *e)
         ++indent;
 
         switch (e->type) {
+        case INCEXPR:
         case ASSIGNEXPR:
                 printf("%*s", indent * indent_size, "");
-                printf("- [name] %s\n", e->assignexpr.name->str_literal);
+                printf("- [name] %s\n", e->assignexpr.name);
                 printf("%*s", indent * indent_size, "");
-                printf("- [value] %s\n", TOKEN_REPR[e->assignexpr.value->type]);
-                printf("%*s", indent * indent_size, "");
-                print_ast_expr_branch(e->assignexpr.value);
+                printf("- [value] ");
+                print_ast_expr_branch(EXPR(e->assignexpr.value));
                 break;
+        case BINEXPR_ADD_NUM:
+        case BINEXPR_SUB_NUM:
+        case BINEXPR_MUL_NUM:
+        case BINEXPR_DIV_NUM:
+        case BINEXPR_BAND_NUM:
+        case BINEXPR_BOR_NUM:
+        case BINEXPR_BXOR_NUM:
+        case BINEXPR_EQ_NUM:
+        case BINEXPR_NE_NUM:
+        case BINEXPR_GT_NUM:
+        case BINEXPR_GE_NUM:
+        case BINEXPR_LT_NUM:
+        case BINEXPR_LE_NUM:
+        case CMPEXPR:
         case BINEXPR:
                 printf("%*s", indent * indent_size, "");
                 printf("- [lhs] ");
-                print_ast_expr_branch(e->binexpr.lhs);
+                print_ast_expr_branch(EXPR(e->binexpr.lhs));
                 printf("%*s", indent * indent_size, "");
-                printf("- [op] %s\n", TOKEN_REPR[e->binexpr.op->token]);
+                printf("- [op] %s\n", TOKEN_REPR[e->binexpr.op]);
                 printf("%*s", indent * indent_size, "");
                 printf("- [rhs] ");
-                print_ast_expr_branch(e->binexpr.rhs);
+                print_ast_expr_branch(EXPR(e->binexpr.rhs));
                 break;
         case UNEXPR:
                 printf("%*s", indent * indent_size, "");
-                printf("- [op] %s\n", TOKEN_REPR[e->unexpr.op->token]);
+                printf("- [op] %s\n", TOKEN_REPR[e->unexpr.op]);
                 printf("%*s", indent * indent_size, "");
                 printf("- [rhs] ");
-                print_ast_expr_branch(e->unexpr.rhs);
+                print_ast_expr_branch(EXPR(e->unexpr.rhs));
                 break;
         case LITEXPR:
                 printf("%*s", indent * indent_size, "");
-                printf("- [lit] ");
-                print_literal(e->litexpr.value);
+                printf("- [lit] %s", TOKEN_REPR[e->litexpr.token]);
+                if (e->litexpr.token == NUMBER)
+                        printf(" %d", e->litexpr.num);
+                else if (e->litexpr.token == STRING)
+                        printf(" \"%s\"", e->litexpr.str);
+                else if (e->litexpr.token == IDENTIFIER)
+                        printf(" `%s`", e->litexpr.str);
                 printf("\n");
                 break;
+        case GETEXPR:
         case CALLEXPR:
                 printf("%*s", indent * indent_size, "");
                 printf("- [CALL] name: ");
-                print_ast_expr_branch(e->callexpr.name);
-                Expr *ex = e->callexpr.args;
-                while (ex) {
+                print_ast_expr_branch(EXPR(e->callexpr.name));
+                for (uint32_t i = 0; i < e->callexpr.args.count; i++) {
                         printf("%*s", indent * indent_size, "");
                         printf("- [Param] ");
-                        print_ast_expr_branch(ex);
-                        ex = ex->next;
+                        print_ast_expr_branch(EXPR(LIST_AT(e->callexpr.args, i)));
                 }
                 break;
         case ANDEXPR:
                 printf("- [AND]\n");
                 printf("%*s", indent * indent_size, "");
                 printf("  - [lhs] ");
-                print_ast_expr_branch(e->andexpr.lhs);
+                print_ast_expr_branch(EXPR(e->andexpr.lhs));
                 printf("%*s", indent * indent_size, "");
                 printf("  - [rhs] ");
-                print_ast_expr_branch(e->andexpr.rhs);
+                print_ast_expr_branch(EXPR(e->andexpr.rhs));
                 break;
         case OREXPR:
                 printf("- [OR]\n");
                 printf("%*s", indent * indent_size, "");
                 printf("  - [lhs] ");
-                print_ast_expr_branch(e->orexpr.lhs);
+                print_ast_expr_branch(EXPR(e->orexpr.lhs));
                 printf("%*s", indent * indent_size, "");
                 printf("  - [rhs] ");
-                print_ast_expr_branch(e->orexpr.rhs);
+                print_ast_expr_branch(EXPR(e->orexpr.rhs));
                 break;
         default:
                 report("print_ast_expr_branch not yet implemeted for %s\n",
@@ -109,60 +136,54 @@ print_ast_expr_branch(Expr *e)
 static void
 print_ast_branch(Stmt *s)
 {
+        NodeList l;
+
         switch (s->type) {
         case EXPRSTMT:
-                print_ast_expr_branch(s->expr.body);
+                print_ast_expr_branch(EXPR(s->expr.body));
                 break;
         case VARDECLSTMT:
-                printf("var %s = ", s->vardecl.name->str_literal);
-                print_ast_expr_branch(s->vardecl.value);
+                printf("var %s = ", s->vardecl.name);
+                print_ast_expr_branch(EXPR(s->vardecl.value));
                 break;
         case ASSERTSTMT:
                 printf("assert ");
-                print_ast_expr_branch(s->assert.body);
+                print_ast_expr_branch(EXPR(s->assert.body));
                 break;
         case IFSTMT:
                 printf("if ");
-                print_ast_expr_branch(s->ifstmt.cond);
+                print_ast_expr_branch(EXPR(s->ifstmt.cond));
                 printf("if true: ");
-                print_ast_branch(s->ifstmt.body);
+                print_ast_branch(STMT(s->ifstmt.body));
                 if (s->ifstmt.elsebody) {
                         printf("if false: ");
-                        print_ast_branch(s->ifstmt.elsebody);
+                        print_ast_branch(STMT(s->ifstmt.elsebody));
                 }
                 break;
         case BLOCKSTMT:
                 printf("block ");
-                s = s->block.body;
-                while (s) {
-                        print_ast_branch(s);
-                        s = s->next;
-                }
+                l = s->block.body;
+                for (uint32_t i = 0; i < l.count; i++)
+                        print_ast_branch(STMT(LIST_AT(l, i)));
                 printf("\n");
                 break;
         case RETSTMT:
                 printf("return: ");
-                print_ast_expr_branch(s->retstmt.value);
+                print_ast_expr_branch(EXPR(s->retstmt.value));
                 break;
         case WHILESTMT:
                 printf("while ");
-                print_ast_expr_branch(s->ifstmt.cond);
+                print_ast_expr_branch(EXPR(s->whilestmt.cond));
                 printf("body: ");
-                print_ast_branch(s->ifstmt.body);
+                print_ast_branch(STMT(s->whilestmt.body));
                 break;
         case FUNDECLSTMT:
-                printf("Function %s (", s->funcdecl.name->str_literal);
-                vtok *ex = s->funcdecl.params;
-                if (ex) {
-                        printf("%s", ex->str_literal);
-                        ex = ex->next;
-                }
-                while (ex) {
-                        printf(", %s", ex->str_literal);
-                        ex = ex->next;
-                }
+                printf("Function %s (", s->funcdecl.name);
+                l = s->funcdecl.params;
+                for (uint32_t i = 0; i < l.count; i++)
+                        printf(i ? ", %s" : "%s", EXPR(LIST_AT(l, i))->litexpr.str);
                 printf(")\n");
-                print_ast_branch(s->funcdecl.body);
+                print_ast_branch(STMT(s->funcdecl.body));
                 break;
         default:
                 report("No yet implemented: print_ast_branch for %s\n",
@@ -175,261 +196,161 @@ void
 print_ast()
 {
         printf("-----------|AST|-----------\n");
-        Stmt *e = head_stmt;
-        while (e) {
-                print_ast_branch(e);
-                e = e->next;
-        }
+        for (uint32_t i = 0; i < ast_program.count; i++)
+                print_ast_branch(STMT(LIST_AT(ast_program, i)));
         printf("---------------------------\n");
 }
 
-static void
-free_exprs(Expr *e)
-{
-        Expr *current = e;
-        while (current) {
-                Expr *next = current->next;
-                switch (current->type) {
-                case ASSIGNEXPR:
-                        free_exprs(current->assignexpr.value);
-                        break;
-                case BINEXPR:
-                        free_exprs(current->binexpr.lhs);
-                        free_exprs(current->binexpr.rhs);
-                        break;
-                case UNEXPR:
-                        free_exprs(current->unexpr.rhs);
-                        break;
-                case CALLEXPR:
-                        free_exprs(current->callexpr.name);
-                        free_exprs(current->callexpr.args);
-                        break;
-                case LITEXPR:
-                        break;
-                case VAREXPR:
-                        free_exprs(current->varexpr.value);
-                        break;
-                case OREXPR:
-                        free_exprs(current->orexpr.lhs);
-                        free_exprs(current->orexpr.rhs);
-                        break;
-                case ANDEXPR:
-                        free_exprs(current->andexpr.lhs);
-                        free_exprs(current->andexpr.rhs);
-                        break;
-                        break;
-                }
-                free(current);
-                current = next;
-        }
-}
-
-static void
-free_stmts(Stmt *s)
-{
-        Stmt *current = s;
-        while (current) {
-                Stmt *next = current->next;
-                switch (current->type) {
-                case VARDECLSTMT:
-                        free_exprs(current->vardecl.value);
-                        break;
-                case BLOCKSTMT:
-                        free_stmts(current->block.body);
-                        break;
-                case EXPRSTMT:
-                        free_exprs(current->expr.body);
-                        break;
-                case ASSERTSTMT:
-                        free_exprs(current->assert.body);
-                        break;
-                case RETSTMT:
-                        free_exprs(current->retstmt.value);
-                        break;
-                case IFSTMT:
-                        free_exprs(current->ifstmt.cond);
-                        free_stmts(current->ifstmt.body);
-                        free_stmts(current->ifstmt.elsebody);
-                        break;
-                case WHILESTMT:
-                        free_exprs(current->whilestmt.cond);
-                        free_stmts(current->whilestmt.body);
-                        break;
-                case FUNDECLSTMT:
-                        free_stmts(current->funcdecl.body);
-                        break;
-                default:
-                        report("free_stmts not yet implemeted for %s\n",
-                               STMT_REPR[current->type]);
-                        panik_exit();
-                }
-                free(current);
-                current = next;
-        }
-}
-
-void
-free_stmt_head()
-{
-        free_stmts(head_stmt);
-}
-
 /* Use only to create a expr of a concrete type */
-static Expr *
-new_expr()
+static NodeRef
+new_expr(Exprtype type)
 {
-        Expr *e = malloc(sizeof(Expr));
-        memset(e, 0, sizeof(Expr));
-        return e;
+        NodeRef r = unit_node();
+        EXPR(r)->type = type;
+        return r;
 }
 
-static Expr *
-new_orexpr(Expr *lhs, Expr *rhs)
+static NodeRef
+new_orexpr(NodeRef lhs, NodeRef rhs)
 {
-        Expr *e = new_expr();
-        e->orexpr.lhs = lhs;
-        e->orexpr.rhs = rhs;
-        e->type = OREXPR;
-        return e;
+        NodeRef r = new_expr(OREXPR);
+        EXPR(r)->orexpr.lhs = lhs;
+        EXPR(r)->orexpr.rhs = rhs;
+        return r;
 }
 
-static Expr *
-new_andexpr(Expr *lhs, Expr *rhs)
+static NodeRef
+new_andexpr(NodeRef lhs, NodeRef rhs)
 {
-        Expr *e = new_expr();
-        e->andexpr.lhs = lhs;
-        e->andexpr.rhs = rhs;
-        e->type = ANDEXPR;
-        return e;
+        NodeRef r = new_expr(ANDEXPR);
+        EXPR(r)->andexpr.lhs = lhs;
+        EXPR(r)->andexpr.rhs = rhs;
+        return r;
 }
 
-static Expr *
-new_binexpr(Expr *lhs, vtok *op, Expr *rhs)
+static NodeRef
+new_binexpr(NodeRef lhs, vtoktype op, NodeRef rhs)
 {
-        Expr *e = new_expr();
-        e->binexpr.lhs = lhs;
-        e->binexpr.op = op;
-        e->binexpr.rhs = rhs;
-        e->type = BINEXPR;
-        return e;
+        NodeRef r = new_expr(BINEXPR);
+        EXPR(r)->binexpr.lhs = lhs;
+        EXPR(r)->binexpr.op = op;
+        EXPR(r)->binexpr.rhs = rhs;
+        return r;
 }
 
-vtok *
-tokdup(vtok *tok)
+/* Start a list, that ends with end_list(START) */
+static int
+begin_list()
 {
-        vtok *t = malloc(sizeof *tok);
-        memcpy(t, tok, sizeof *tok);
-        t->next = NULL;
-        return t;
+        return arrlen(pending);
 }
 
-static void
-append_arg_tok(vtok **arg, vtok *new)
+static NodeList
+end_list(int start)
 {
-        if (*arg == NULL) {
-                *arg = tokdup(new);
-                return;
-        }
-        vtok *e = *arg;
-        while (e->next)
-                e = e->next;
-        e->next = tokdup(new);
+        NodeList l;
+        l.count = arrlen(pending) - start;
+        l.start = unit_list(l.count);
+        memcpy(ast_lists + l.start, pending + start, sizeof(NodeRef) * l.count);
+        arrsetlen(pending, start);
+        return l;
 }
 
-static void
-append_arg_expr(Expr **arg, Expr *new)
-{
-        if (*arg == NULL)
-                *arg = new;
-        else {
-                __auto_type e = *arg;
-                while (e->next)
-                        e = e->next;
-                e->next = new;
-        }
+static NodeRef
+new_call(NodeRef name, NodeList args)
+{
+        NodeRef r = new_expr(CALLEXPR);
+        EXPR(r)->callexpr.name = name;
+        EXPR(r)->callexpr.args = args;
+        return r;
 }
 
-static Expr *
-new_call(Expr *name, Expr *arg, int argc)
+static NodeRef
+new_unexpr(vtoktype op, NodeRef rhs)
 {
-        Expr *e = new_expr();
-        e->callexpr.name = name;
-        e->callexpr.args = arg;
-        e->callexpr.count = argc;
-        e->type = CALLEXPR;
-        return e;
+        NodeRef r = new_expr(UNEXPR);
+        EXPR(r)->unexpr.rhs = rhs;
+        EXPR(r)->unexpr.op = op;
+        return r;
 }
 
-static Expr *
-new_unexpr(vtok *op, Expr *rhs)
+static NodeRef
+new_assignexpr(TokRef name, NodeRef value)
 {
-        Expr *e = new_expr();
-        e->unexpr.rhs = rhs;
-        e->unexpr.op = op;
-        e->type = UNEXPR;
-        return e;
+        NodeRef r = new_expr(ASSIGNEXPR);
+        EXPR(r)->assignexpr.name = TOK_STR(name);
+        EXPR(r)->assignexpr.value = value;
+        return r;
 }
 
-static Expr *
-new_assignexpr(vtok *name, Expr *value)
+static NodeRef
+new_litexpr(TokRef value)
 {
-        Expr *e = new_expr();
-        e->assignexpr.name = name;
-        e->assignexpr.value = value;
-        e->type = ASSIGNEXPR;
-        return e;
+        NodeRef r = new_expr(LITEXPR);
+        Expr *e = EXPR(r);
+        e->litexpr.token = TOK_KIND(value);
+        if (TOK_KIND(value) == NUMBER)
+                e->litexpr.num = TOK_NUM(value);
+        else
+                e->litexpr.str = TOK_STR(value);
+        return r;
 }
 
-static Expr *
-new_litexpr(vtok *value)
+static NodeRef
+new_numexpr(int n)
 {
-        Expr *e = new_expr();
-        e->litexpr.value = value;
-        e->type = LITEXPR;
-        return e;
+        NodeRef r = new_expr(LITEXPR);
+        EXPR(r)->litexpr.token = NUMBER;
+        EXPR(r)->litexpr.num = n;
+        return r;
 }
 
-static vtok *
+static TokRef
 get_token()
 {
         return current_token;
 }
 
-static vtok *
+/* The last token, END_OF_FILE, is never consumed */
+static TokRef
 consume_token()
 {
-        if (current_token) current_token = current_token->next;
+        if (TOK_KIND(current_token) != END_OF_FILE) ++current_token;
         return current_token;
 }
 
-static vtok *
+static TokRef
 match(vtoktype token)
 {
-        vtok *tok = get_token();
-        if (tok->token == token) {
+        TokRef tok = get_token();
+        if (TOK_KIND(tok) == token) {
                 consume_token();
                 return tok;
         }
-        return NULL;
+        return 0;
 }
 
 static void
-report_expected_token(const char *expected, const char *current, vtok *pos)
+report_expected_token(const char *expected, const char *current, TokRef pos)
 {
+        int line, column;
+
         report("Expected %s but got %s ", expected, current);
-        if (pos)
-                report("at line %d, offset %lu", pos->line, pos->offset);
+        if (pos) {
+                tok_position(pos, &line, &column);
+                report("at line %d, offset %d", line, column);
+        }
         printf("\n");
         return;
 }
 
-static vtok *
+static TokRef
 get_expect_consume(vtoktype expected)
 {
-        vtok *tok = get_token();
-        if (tok->token != expected) {
+        TokRef tok = get_token();
+        if (TOK_KIND(tok) != expected) {
                 report_expected_token(TOKEN_REPR[expected],
-                                      TOKEN_REPR[tok->token], tok);
+                                      TOKEN_REPR[TOK_KIND(tok)], tok);
                 panik_exit();
         }
         consume_token();
@@ -439,10 +360,10 @@ get_expect_consume(vtoktype expected)
 static void
 expect(vtoktype expected)
 {
-        vtok *tok = get_token();
-        if (tok->token != expected) {
+        TokRef tok = get_token();
+        if (TOK_KIND(tok) != expected) {
                 report_expected_token(TOKEN_REPR[expected],
-                                      TOKEN_REPR[tok->token], tok);
+                                      TOKEN_REPR[TOK_KIND(tok)], tok);
                 panik_exit();
         }
 }
@@ -453,341 +374,280 @@ expect_consume(vtoktype expected)
         /* I add EOF here so I can evaluate a single expression witout
          * provide the semicolon.
          * This is not a feature, but a humman-bug fix */
-        if (expected == SEMICOLON && get_token()->token == END_OF_FILE) return;
+        if (expected == SEMICOLON && TOK_KIND(get_token()) == END_OF_FILE) return;
         expect(expected);
         consume_token();
 }
 
-/* Convert the literal string into a valid string. Eg: expand '\' */
-static void
-normalize(vtok *t)
-{
-        char *c = t->str_literal;
-        static const char escape_lookup[] = {
-                ['a'] = '\a',
-                ['b'] = '\b',
-                ['t'] = '\t',
-                ['n'] = '\n',
-                ['v'] = '\v',
-                ['f'] = '\f',
-                ['r'] = '\r',
-        };
-
-        while (*c && (c = strchr(c, '\\'))) {
-                switch (c[1]) {
-                case 'a':
-                case 'b':
-                case 't':
-                case 'n':
-                case 'v':
-                case 'f':
-                case 'r':
-                        *c = escape_lookup[c[1]];
-                        break;
-                default:
-                        *c = c[1];
-                        break;
-                }
-                if (c[1]) strcpy(c + 1, c + 2);
-                c++;
-        }
-}
-
-static void
-link_stmt(Stmt *s)
-{
-        if (head_stmt == NULL) {
-                head_stmt = s;
-                return;
-        }
-        Stmt *last = head_stmt;
-        while (last->next)
-                last = last->next;
-        last->next = s;
-}
-
-static vtok *
-is_literal()
-{
-        vtok *t;
-        if ((t = match(NUMBER)) ||
-            (t = match(STRING)) ||
-            (t = match(IDENTIFIER)) ||
-            (t = match(TRUE)) ||
-            (t = match(FALSE)))
-                return t;
-        return NULL;
-}
-
-static Expr *
-get_literal()
-{
-        vtok *t;
-        if ((t = is_literal())) {
-                if (t->token == STRING) normalize(t);
-                return new_litexpr(t);
-        }
-        /* can't be used expect() because LITERAL is an expression, not a token */
-        report_expected_token("LITERAL", TOKEN_REPR[get_token()->token], t);
-        panik_exit();
-        return NULL;
-}
-
-Expr *get_expression();
-
-static Expr *
-get_group()
-{
-        Expr *e;
-        if (match(LEFT_PARENT)) {
-                e = get_expression();
-                expect_consume(RIGHT_PARENT);
-                return e;
-        }
-        return get_literal();
-}
-
-#define MAX_ARGC 3
-static Expr *
-get_call()
-{
-        Expr *e = get_group();
-        if (match(LEFT_PARENT)) {
-                int argc = 0;
-                Expr *arg = NULL;
-                while (!match(RIGHT_PARENT)) {
-                        if (argc > 0) expect_consume(COMMA);
-                        append_arg_expr(&arg, get_expression());
-                        ++argc;
-                        // if (argc > MAX_ARGC) {
-                        //         report("Too much arguments! "
-                        //                "Implementation only support %d\n",
-                        //                MAX_ARGC);
-                        //         panik_exit();
-                        // }
-                }
-                return new_call(e, arg, argc);
-        }
-        return e;
-}
-
-static Expr *
-get_unary()
-{
-        vtok *op;
-        if ((op = match(MINUS)) || (op = match(BANG))) {
-                return new_unexpr(op, get_unary());
-        } else
-                return get_call();
-}
-
-static Expr *
-get_factor()
-{
-        Expr *e = get_unary();
-        vtok *op;
-        while ((op = match(SLASH)) || (op = match(STAR))) {
-                e = new_binexpr(e, op, get_unary());
-        }
+/* Expressions are parsed by precedence climbing (Pratt). Each token kind
+ * has a rule: how to parse an expression that starts with it (prefix),
+ * how to parse one where it follows an operand (infix), and how tightly
+ * it binds as infix. A new operator is a new rule. && binds looser than
+ * ||, and both group to the right */
+typedef enum Prec {
+        PREC_NONE,
+        PREC_AND, // &&
+        PREC_OR, // ||
+        PREC_BOR, // |
+        PREC_BXOR, // ^
+        PREC_BAND, // &
+        PREC_EQUALITY, // == !=
+        PREC_COMPARISON, // > >= < <=
+        PREC_SHIFT, // << >>
+        PREC_TERM, // + -
+        PREC_FACTOR, // * /
+        PREC_UNARY, // - ! ~
+        PREC_CALL, // f(...)
+} Prec;
+
+static NodeRef get_expression();
+static NodeRef get_precedence(Prec min);
+
+static NodeRef
+get_literal(TokRef t)
+{
+        return new_litexpr(t);
+}
+
+static NodeRef
+get_group(TokRef t)
+{
+        (void) t;
+        NodeRef e = get_expression();
+        expect_consume(RIGHT_PARENT);
         return e;
 }
 
-static Expr *
-get_term()
+static NodeRef
+get_unary(TokRef op)
 {
-        Expr *e = get_factor();
-        vtok *op;
-        while ((op = match(MINUS)) || (op = match(PLUS))) {
-                e = new_binexpr(e, op, get_factor());
-        }
-        return e;
+        return new_unexpr(TOK_KIND(op), get_precedence(PREC_UNARY));
 }
 
-static Expr *
-get_comparison()
+#define MAX_ARGC 3
+static NodeRef
+get_call(NodeRef e, TokRef t)
 {
-        Expr *e = get_term();
-        vtok *op;
-        while ((op = match(GREATER)) ||
-               (op = match(GREATER_EQUAL)) ||
-               (op = match(LESS)) ||
-               (op = match(LESS_EQUAL))) {
-                e = new_binexpr(e, op, get_term());
+        (void) t;
+        int argc = 0;
+        int args = begin_list();
+        while (!match(RIGHT_PARENT)) {
+                if (argc > 0) expect_consume(COMMA);
+                NodeRef arg = get_expression();
+                arrput(pending, arg);
+                ++argc;
+                // if (argc > MAX_ARGC) {
+                //         report("Too much arguments! "
+                //                "Implementation only support %d\n",
+                //                MAX_ARGC);
+                //         panik_exit();
+                // }
         }
-        return e;
-}
-
-static Expr *
-get_equality()
-{
-        Expr *e = get_comparison();
-        vtok *op;
-        while ((op = match(EQUAL_EQUAL)) || (op = match(BANG_EQUAL))) {
-                e = new_binexpr(e, op, get_comparison());
+        return new_call(e, end_list(args));
+}
+
+static NodeRef get_binary(NodeRef lhs, TokRef op);
+static NodeRef get_and(NodeRef lhs, TokRef op);
+static NodeRef get_or(NodeRef lhs, TokRef op);
+
+static const struct {
+        NodeRef (*prefix)(TokRef);
+        NodeRef (*infix)(NodeRef, TokRef);
+        Prec prec;
+} rules[UNKNOWN + 1] = {
+        [NUMBER] = { get_literal, NULL, PREC_NONE },
+        [STRING] = { get_literal, NULL, PREC_NONE },
+        [IDENTIFIER] = { get_literal, NULL, PREC_NONE },
+        [TRUE] = { get_literal, NULL, PREC_NONE },
+        [FALSE] = { get_literal, NULL, PREC_NONE },
+        [LEFT_PARENT] = { get_group, get_call, PREC_CALL },
+        [BANG] = { get_unary, NULL, PREC_NONE },
+        [BITWISE_NOT] = { get_unary, NULL, PREC_NONE },
+        [MINUS] = { get_unary, get_binary, PREC_TERM },
+        [PLUS] = { NULL, get_binary, PREC_TERM },
+        [STAR] = { NULL, get_binary, PREC_FACTOR },
+        [SLASH] = { NULL, get_binary, PREC_FACTOR },
+        [SHIFT_LEFT] = { NULL, get_binary, PREC_SHIFT },
+        [SHIFT_RIGHT] = { NULL, get_binary, PREC_SHIFT },
+        [GREATER] = { NULL, get_binary, PREC_COMPARISON },
+        [GREATER_EQUAL] = { NULL, get_binary, PREC_COMPARISON },
+        [LESS] = { NULL, get_binary, PREC_COMPARISON },
+        [LESS_EQUAL] = { NULL, get_binary, PREC_COMPARISON },
+        [EQUAL_EQUAL] = { NULL, get_binary, PREC_EQUALITY },
+        [BANG_EQUAL] = { NULL, get_binary, PREC_EQUALITY },
+        [BITWISE_AND] = { NULL, get_binary, PREC_BAND },
+        [BITWISE_XOR] = { NULL, get_binary, PREC_BXOR },
+        [BITWISE_OR] = { NULL, get_binary, PREC_BOR },
+        [OR] = { NULL, get_or, PREC_OR },
+        [AND] = { NULL, get_and, PREC_AND },
+};
+
+/* Left operand binds to the operator, so a - b - c is (a - b) - c */
+static NodeRef
+get_binary(NodeRef lhs, TokRef op)
+{
+        Prec prec = rules[TOK_KIND(op)].prec;
+        return new_binexpr(lhs, TOK_KIND(op), get_precedence(prec + 1));
+}
+
+static NodeRef
+get_or(NodeRef lhs, TokRef op)
+{
+        (void) op;
+        return new_orexpr(lhs, get_precedence(PREC_OR));
+}
+
+static NodeRef
+get_and(NodeRef lhs, TokRef op)
+{
+        (void) op;
+        return new_andexpr(lhs, get_precedence(PREC_AND));
+}
+
+/* Expression whose operators bind at least as tight as MIN */
+static NodeRef
+get_precedence(Prec min)
+{
+        TokRef t = get_token();
+        NodeRef e;
+
+        if (!rules[TOK_KIND(t)].prefix) {
+                /* can't be used expect() because LITERAL is an expression, not a token */
+                report_expected_token("LITERAL", TOKEN_REPR[TOK_KIND(t)], 0);
+                panik_exit();
         }
-        return e;
-}
+        consume_token();
+        e = rules[TOK_KIND(t)].prefix(t);
 
-static Expr *
-get_or()
-{
-        Expr *e = get_equality();
-        if (match(OR)) {
-                e = new_orexpr(e, get_or());
+        while (rules[TOK_KIND(t = get_token())].prec >= min) {
+                consume_token();
+                e = rules[TOK_KIND(t)].infix(e, t);
         }
         return e;
 }
 
-static Expr *
-get_and()
+/* ID++ and ID-- are parsed as ID = ID + 1 and ID = ID - 1. As in C,
+ * their value is the one ID had before, so if it is used they are
+ * (ID = ID + 1) - 1 */
+static NodeRef
+new_increment(TokRef id, TokRef t, int value)
 {
-        Expr *e = get_or();
-        if (match(AND)) {
-                e = new_andexpr(e, get_and());
-        }
-        return e;
+        vtoktype op = TOK_KIND(t) == PLUS_PLUS ? PLUS : MINUS;
+        NodeRef e = new_assignexpr(id, new_binexpr(new_litexpr(id), op,
+                                                   new_numexpr(1)));
+        if (!value) return e;
+        return new_binexpr(e, op == PLUS ? MINUS : PLUS, new_numexpr(1));
 }
 
-static Expr *
+static NodeRef
 get_assignment()
 {
-        vtok *id;
+        TokRef id;
+        TokRef t;
         if ((id = match(IDENTIFIER))) {
                 if (match(EQUAL))
                         return new_assignexpr(id, get_assignment());
+                if ((t = match(PLUS_PLUS)) || (t = match(LESS_LESS)))
+                        return new_increment(id, t, 1);
                 current_token = id;
         }
-        return get_and();
+        return get_precedence(PREC_AND);
 }
 
-Expr *
+static NodeRef
 get_expression()
 {
         return get_assignment();
 }
 
-static Stmt *
-new_stmt()
+static NodeRef
+new_stmt(Stmttype type)
 {
-        return calloc(1, sizeof(Stmt));
+        NodeRef r = unit_node();
+        STMT(r)->type = type;
+        return r;
 }
 
-static Stmt *
-new_blockstmt()
+static NodeRef
+new_exprstmt(NodeRef e)
 {
-        Stmt *s = new_stmt();
-        s->type = BLOCKSTMT;
-        s->block.body = NULL;
-        return s;
+        NodeRef r = new_stmt(EXPRSTMT);
+        STMT(r)->expr.body = e;
+        return r;
 }
 
-static Stmt *
-new_exprstmt(Expr *e)
+static NodeRef
+new_whilestmt(NodeRef e, NodeRef body)
 {
-        Stmt *s = new_stmt();
-        s->type = EXPRSTMT;
-        s->expr.body = e;
-        return s;
+        NodeRef r = new_stmt(WHILESTMT);
+        STMT(r)->whilestmt.cond = e;
+        STMT(r)->whilestmt.body = body;
+        return r;
 }
 
-static Stmt *
-new_whilestmt(Expr *e, Stmt *body)
+static NodeRef
+new_return(NodeRef e)
 {
-        Stmt *s = new_stmt();
-        s->type = WHILESTMT;
-        s->whilestmt.cond = e;
-        s->whilestmt.body = body;
-        return s;
+        NodeRef r = new_stmt(RETSTMT);
+        STMT(r)->retstmt.value = e;
+        return r;
 }
 
-static Stmt *
-new_return(Expr *e)
+static NodeRef
+new_ifstmt(NodeRef e, NodeRef body, NodeRef elsebody)
 {
-        Stmt *s = new_stmt();
-        s->type = RETSTMT;
-        s->retstmt.value = e;
-        return s;
+        NodeRef r = new_stmt(IFSTMT);
+        STMT(r)->ifstmt.cond = e;
+        STMT(r)->ifstmt.body = body;
+        STMT(r)->ifstmt.elsebody = elsebody;
+        return r;
 }
 
-static Stmt *
-new_ifstmt(Expr *e, Stmt *body, Stmt *elsebody)
+static NodeRef
+new_funcdecl(TokRef name, NodeList params, NodeRef body)
 {
-        Stmt *s = new_stmt();
-        s->type = IFSTMT;
-        s->ifstmt.cond = e;
-        s->ifstmt.body = body;
-        s->ifstmt.elsebody = elsebody;
-        return s;
+        NodeRef r = new_stmt(FUNDECLSTMT);
+        STMT(r)->funcdecl.name = TOK_STR(name);
+        STMT(r)->funcdecl.params = params;
+        STMT(r)->funcdecl.body = body;
+        return r;
 }
 
-static Stmt *
-new_funcdecl(vtok *name, vtok *params, int arity, Stmt *body)
+static NodeRef
+new_assertstmt(NodeRef e)
 {
-        Stmt *s = new_stmt();
-        s->type = FUNDECLSTMT;
-        s->funcdecl.name = name;
-        s->funcdecl.params = params;
-        s->funcdecl.arity = arity;
-        s->funcdecl.body = body;
-        return s;
+        NodeRef r = new_stmt(ASSERTSTMT);
+        STMT(r)->assert.body = e;
+        return r;
 }
 
-static Stmt *
-new_assertstmt(Expr *e)
+static NodeRef
+new_vardecl(TokRef id, NodeRef value)
 {
-        Stmt *s = new_stmt();
-        s->type = ASSERTSTMT;
-        s->assert.body = e;
-        return s;
+        NodeRef r = new_stmt(VARDECLSTMT);
+        STMT(r)->vardecl.name = TOK_STR(id);
+        STMT(r)->vardecl.value = value;
+        return r;
 }
 
-static Stmt *
-new_vardecl(vtok *id, Expr *value)
-{
-        Stmt *s = new_stmt();
-        s->type = VARDECLSTMT;
-        s->vardecl.name = id;
-        s->vardecl.value = value;
-        return s;
-}
+static NodeRef get_declaration();
 
-static void
-blockstmt_addstmt(Stmt *block, Stmt *s)
-{
-        if (block->block.body == NULL) {
-                block->block.body = s;
-                return;
-        }
-        Stmt *current = block->block.body;
-        while (current->next)
-                current = current->next;
-        current->next = s;
-}
-
-static Stmt *get_declaration();
-
-static Stmt *
+static NodeList
 get_program()
 {
-        Stmt *c = NULL;
-        Stmt *ret;
-        Stmt *s;
-        while (get_token()->token != END_OF_FILE) {
-                s = get_declaration();
-                if (c) {
-                        c->next = s;
-                } else
-                        ret = s;
-                c = s;
+        int program = begin_list();
+        while (TOK_KIND(get_token()) != END_OF_FILE) {
+                NodeRef s = get_declaration();
+                arrput(pending, s);
         }
-        return ret;
+        return end_list(program);
 }
 
-static Stmt *get_vardecl();
-static Stmt *get_funcdecl();
-static Stmt *get_stmt();
+static NodeRef get_vardecl();
+static NodeRef get_funcdecl();
+static NodeRef get_stmt();
 
-static Stmt *
+static NodeRef
 get_declaration()
 {
         if (match(VAR)) return get_vardecl();
@@ -795,22 +655,20 @@ get_declaration()
         return get_stmt();
 }
 
-static Expr *
+static NodeRef
 littok_novalue()
 {
-        Expr *e = new_expr();
-        e->litexpr.value = calloc(1, sizeof(vtok));
-        e->litexpr.value->str_literal = "no-value";
-        e->litexpr.value->token = STRING;
-        e->type = LITEXPR;
-        return e;
+        NodeRef r = new_expr(LITEXPR);
+        EXPR(r)->litexpr.str = str_intern("no-value", 8)->chars;
+        EXPR(r)->litexpr.token = STRING;
+        return r;
 }
 
-static Stmt *
+static NodeRef
 get_vardecl()
 {
-        Expr *value = NULL;
-        vtok *id = get_expect_consume(IDENTIFIER);
+        NodeRef value;
+        TokRef id = get_expect_consume(IDENTIFIER);
         if (match(EQUAL)) {
                 value = get_expression();
         } else
@@ -819,35 +677,37 @@ get_vardecl()
         return new_vardecl(id, value);
 }
 
-static Stmt *get_block();
+static NodeRef get_block();
 
-static Stmt *
+static NodeRef
 get_funcdecl()
 {
         // func a(a, b) {
         // }
-        vtok *param = NULL;
+        int params = begin_list();
         int paramc = 0;
-        vtok *id = get_expect_consume(IDENTIFIER);
+        TokRef id = get_expect_consume(IDENTIFIER);
         expect_consume(LEFT_PARENT);
         while (!match(RIGHT_PARENT)) {
                 if (paramc > 0) expect_consume(COMMA);
-                append_arg_tok(&param, get_token());
+                NodeRef param = new_litexpr(get_token());
+                arrput(pending, param);
                 consume_token();
                 ++paramc;
         }
         expect_consume(LEFT_BRACE);
-        return new_funcdecl(id, param, paramc, get_block());
+        NodeList l = end_list(params);
+        return new_funcdecl(id, l, get_block());
 }
 
-static Stmt *get_block();
-static Stmt *get_exprstmt();
-static Stmt *get_assert();
-static Stmt *get_ifstmt();
-static Stmt *get_whilestmt();
-static Stmt *get_return();
+static NodeRef get_block();
+static NodeRef get_exprstmt();
+static NodeRef get_assert();
+static NodeRef get_ifstmt();
+static NodeRef get_whilestmt();
+static NodeRef get_return();
 
-static Stmt *
+static NodeRef
 get_stmt()
 {
         if (match(ASSERT)) return get_assert();
@@ -858,85 +718,101 @@ get_stmt()
         return get_exprstmt();
 }
 
-static Stmt *
+static NodeRef
 get_whilestmt()
 {
         expect_consume(LEFT_PARENT);
-        Expr *e = get_expression();
+        NodeRef e = get_expression();
         expect_consume(RIGHT_PARENT);
         return new_whilestmt(e, get_declaration());
 }
 
-static Stmt *
+static NodeRef
 get_return()
 {
-        Stmt *s = new_return(get_expression());
+        NodeRef s = new_return(get_expression());
         expect_consume(SEMICOLON);
         return s;
 }
 
-static Stmt *
+static NodeRef
 get_ifstmt()
 {
         expect_consume(LEFT_PARENT);
-        Expr *e = get_expression();
+        NodeRef e = get_expression();
         expect_consume(RIGHT_PARENT);
-        Stmt *body = get_declaration();
-        Stmt *elsebody = NULL;
+        NodeRef body = get_declaration();
+        NodeRef elsebody = 0;
         if (match(ELSE)) {
                 elsebody = get_declaration();
         }
         return new_ifstmt(e, body, elsebody);
 }
 
-static Stmt *
+static NodeRef
 get_exprstmt()
 {
-        Stmt *s = new_exprstmt(get_expression());
+        TokRef id, t;
+        NodeRef s;
+
+        /* Value of ID++; is not used: keep the shape the optimizer fuses */
+        if ((id = match(IDENTIFIER))) {
+                if (((t = match(PLUS_PLUS)) || (t = match(LESS_LESS))) &&
+                    match(SEMICOLON))
+                        return new_exprstmt(new_increment(id, t, 0));
+                current_token = id;
+        }
+        s = new_exprstmt(get_expression());
         expect_consume(SEMICOLON);
         return s;
 }
 
-static Stmt *
+static NodeRef
 get_assert()
 {
-        Stmt *s = new_assertstmt(get_expression());
+        NodeRef s = new_assertstmt(get_expression());
         expect_consume(SEMICOLON);
         return s;
 }
 
-static Stmt *
+static NodeRef
 get_block()
 {
-        Stmt *s = new_blockstmt();
-        while (!match(RIGHT_BRACE))
-                blockstmt_addstmt(s, get_declaration());
-        return s;
+        NodeRef r = new_stmt(BLOCKSTMT);
+        int body = begin_list();
+        while (!match(RIGHT_BRACE)) {
+                NodeRef s = get_declaration();
+                arrput(pending, s);
+        }
+        STMT(r)->block.body = end_list(body);
+        return r;
 }
 
 void
 tok_parse()
 {
-        if (head_token == NULL) {
+        if (tokens.count <= 1) {
                 report("tok_parse: invalid token list. Call lex_analize() first.\n");
                 exit(1);
         }
 
-        head_stmt = NULL;
-        current_token = head_token;
+        ast_program = (NodeList) { 0 };
+        current_token = 1;
 
         /* Set point to reset after failure */
         if (setjmp(panik_jmp)) {
                 /* This is executed after failure. Go down to the
                  * next semicolon, as current expression failed. After
-                 * the semicolon it should continue without problems. */
-                vtok *tok;
+                 * the semicolon it should continue without problems.
+                 * Statements before the failure are discarded. */
+                TokRef tok;
+                arrsetlen(pending, 0);
                 for (;;) {
                         tok = get_token();
-                        if (tok->token == END_OF_FILE) return;
+                        if (TOK_KIND(tok) == END_OF_FILE) return;
                         consume_token();
-                        if (tok->token == SEMICOLON) break;
+                        if (TOK_KIND(tok) == SEMICOLON) break;
                 }
         }
-        link_stmt(get_program());
+        ast_program = get_program();
 }
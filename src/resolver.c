@@ -1,22 +1,58 @@
 #include <setjmp.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #include "env.h"
 #include "interpreter.h"
 #include "tokens.h"
+#include "unit.h"
 
 #include "stb_ds.h"
 
 jmp_buf resolve_error_jmp;
 
-#define DECLARED ((Value) { .type = TYPE_NUM, .num = 1 })
-#define DEFINED ((Value) { .type = TYPE_NUM, .num = 3 })
-#define UNDEFINED ((Value) { .type = TYPE_NUM, .num = 0 })
+/* Compile time view of an Env: the slot assigned to each name. The
+ * global scope is the one kept by env.c, so it is represented as NULL.
+ * Names are interned by the lexer, so maps are keyed by address.
+ *
+ * Scopes do not see past the function they are in. A name declared
+ * outside it (but not global) is captured: the function gets a list of
+ * the variables it captures, resolved where it is declared, and keeps
+ * their cells when it is created. They come after the parameters in the
+ * env of each call, so inside the function they are one more variable
+ * of that env. The captured variable is kept in a cell by the env that
+ * declares it, so both see the same value, and the references to it are
+ * resolved with CELL_DEPTH. References found before it was captured are
+ * kept to be changed then. */
+typedef struct Var {
+        int slot;
+        int cell;
+        int **refs; // depth of the references that do not know about the cell
+} Var;
 
+typedef struct Scope {
+        struct {
+                char *key;
+                Var value;
+        } *map;
+        int size;
+        struct Scope *upper;
+} Scope;
 
-struct {
-        void *key;
-        int value;
-} *sidetable = NULL;
+/* Function being resolved */
+typedef struct Closure {
+        Scope *params; // its outermost scope
+        int arity;
+        struct {
+                char *key;
+                int value;
+        } *captures;    // name to index
+        NodeRef *nodes; // identifiers of the captures
+        struct Closure *upper;
+} Closure;
+
+static Scope *scope = NULL;
+static Closure *closure = NULL;
 
 static void
 resolve_error()
@@ -25,114 +61,175 @@ resolve_error()
 }
 
 static void
-sidetable_add_expr(Expr *e)
+scope_create()
 {
-        switch (e->type) {
-        case LITEXPR:
-                if (e->litexpr.value->token != IDENTIFIER) {
-                        report("sidetable_add_expr case LITEXPR for literal not identifier: error\n");
-                        resolve_error();
-                }
-                hmput(sidetable, e, env_get_offset(e->litexpr.value->str_literal));
-                break;
-        case ASSIGNEXPR:
-                hmput(sidetable, e, env_get_offset(e->assignexpr.name->str_literal));
-                break;
-        default:
-                report("No yet implemented: sidetable_add_expr for %s\n",
-                       EXPR_REPR[e->type]);
-                resolve_error();
-        }
+        Scope *s = calloc(1, sizeof(Scope));
+        s->upper = scope;
+        scope = s;
+}
+
+/* Destroy current scope and return the number of slots it needs */
+static int
+scope_destroy()
+{
+        Scope *s = scope;
+        int size = s->size;
+        scope = s->upper;
+        for (int i = 0; i < hmlen(s->map); i++)
+                arrfree(s->map[i].value.refs);
+        hmfree(s->map);
+        free(s);
+        return size;
 }
 
 static void
-sidetable_add_stmt(Stmt *s)
+closure_create(int arity)
 {
-        switch (s->type) {
-        default:
-                report("No yet implemented: sidetable_add_stmt for %s\n",
-                       STMT_REPR[s->type]);
-                resolve_error();
-        }
+        Closure *c = calloc(1, sizeof(Closure));
+        c->params = scope;
+        c->arity = arity;
+        c->upper = closure;
+        closure = c;
 }
 
+static void
+closure_destroy()
+{
+        Closure *c = closure;
+        closure = c->upper;
+        hmfree(c->captures);
+        arrfree(c->nodes);
+        free(c);
+}
+
+/* Add NAME to current scope and return its slot */
 static int
-sidetable_get(void *e)
+declare(char *name)
 {
-        int i;
-        i = hmgeti(sidetable, e);
-        if (i < 0) {
-                report("Can not resolve %p\n", e);
+        int slot;
+        if (scope == NULL) {
+                slot = env_global_declare(name);
+        } else if (hmgeti(scope->map, name) >= 0) {
+                slot = -1;
+        } else {
+                slot = scope->size++;
+                hmput(scope->map, name, ((Var) { .slot = slot }));
+        }
+        if (slot < 0) {
+                report("Var `%s` already declared\n", name);
                 resolve_error();
         }
-        return sidetable[i].value;
+        return slot;
 }
 
+/* Keep V in a cell from now on */
 static void
-define(char *name)
+make_cell(Var *v)
 {
-        env_add(name, DEFINED);
+        if (v->cell) return;
+        v->cell = 1;
+        for (int i = 0; i < arrlen(v->refs); i++)
+                *v->refs[i] |= CELL_DEPTH;
+        arrfree(v->refs);
 }
 
-static void
-declare(char *name)
+static int capture(Closure *c, char *name);
+
+/* Set DEPTH and SLOT to the position of NAME as seen from scope S, that
+ * is inside function C (NULL at top level). If CAPTURED, the variable
+ * is kept in a cell. Return 0 if NAME is not a local variable */
+static int
+lookup_local(Scope *s, Closure *c, char *name, int *depth, int *slot, int captured)
 {
-        env_add(name, DECLARED);
+        Var *v;
+        int i, d = 0;
+
+        for (; s; s = s->upper, ++d) {
+                if ((i = hmgeti(s->map, name)) >= 0) {
+                        v = &s->map[i].value;
+                        if (captured) make_cell(v);
+                        if (!v->cell) arrput(v->refs, depth);
+                        *depth = v->cell ? d | CELL_DEPTH : d;
+                        *slot = v->slot;
+                        return 1;
+                }
+                if (c && s == c->params) {
+                        if ((i = capture(c, name)) < 0) return 0;
+                        *depth = d | CELL_DEPTH;
+                        *slot = c->arity + i;
+                        return 1;
+                }
+        }
+        return 0;
 }
 
-static void
-check_declared(char *name)
+/* Index of NAME in the captures of C, or -1 if it is global */
+static int
+capture(Closure *c, char *name)
 {
-        if (env_get(name).num & DECLARED.num) return;
-        report("check_declared: var `%s` not declared\n", name);
-        resolve_error();
+        int depth, slot, i;
+        NodeRef r;
+
+        if ((i = hmgeti(c->captures, name)) >= 0) return c->captures[i].value;
+        if (!lookup_local(c->params->upper, c->upper, name, &depth, &slot, 1))
+                return -1;
+
+        r = unit_node();
+        EXPR(r)->type = LITEXPR;
+        EXPR(r)->litexpr.token = IDENTIFIER;
+        EXPR(r)->litexpr.str = name;
+        EXPR(r)->litexpr.depth = depth;
+        EXPR(r)->litexpr.slot = slot;
+        hmput(c->captures, name, arrlen(c->nodes));
+        arrput(c->nodes, r);
+        return arrlen(c->nodes) - 1;
 }
 
+/* Set DEPTH and SLOT to the position of NAME as seen from current scope */
 static void
-resolve_declaration(Stmt *s)
+lookup(char *name, int *depth, int *slot)
 {
-        switch (s->type) {
-        default:
-                report("No yet implemented: resolve_declaration for %s\n",
-                       STMT_REPR[s->type]);
+        if (lookup_local(scope, closure, name, depth, slot, 0)) return;
+        *depth = GLOBAL_DEPTH;
+        if ((*slot = env_global_slot(name)) < 0) {
+                report("Var `%s` not declared\n", name);
                 resolve_error();
-                break;
         }
 }
 
-static void resolve_expr_arr(Expr *e);
+static void resolve_expr_list(NodeList l);
 
 static void
 resolve_expr(Expr *e)
 {
         switch (e->type) {
         case LITEXPR:
-                if (e->litexpr.value->token != IDENTIFIER) return;
-                sidetable_add_expr(e);
+                if (e->litexpr.token != IDENTIFIER) return;
+                lookup(e->litexpr.str, &e->litexpr.depth, &e->litexpr.slot);
                 break;
         case CALLEXPR:
-                resolve_expr_arr(e->callexpr.args);
-                resolve_expr(e->callexpr.name);
+                resolve_expr_list(e->callexpr.args);
+                resolve_expr(EXPR(e->callexpr.name));
                 break;
         case ASSIGNEXPR:
-                check_declared(e->assignexpr.name->str_literal);
-                sidetable_add_expr(e);
-                resolve_expr(e->assignexpr.value);
+                lookup(e->assignexpr.name,
+                       &e->assignexpr.depth, &e->assignexpr.slot);
+                resolve_expr(EXPR(e->assignexpr.value));
                 break;
         case BINEXPR:
-                resolve_expr(e->binexpr.lhs);
-                resolve_expr(e->binexpr.rhs);
+                resolve_expr(EXPR(e->binexpr.lhs));
+                resolve_expr(EXPR(e->binexpr.rhs));
                 break;
         case UNEXPR:
-                resolve_expr(e->unexpr.rhs);
+                resolve_expr(EXPR(e->unexpr.rhs));
                 break;
         case OREXPR:
-                resolve_expr(e->orexpr.lhs);
-                resolve_expr(e->orexpr.rhs);
+                resolve_expr(EXPR(e->orexpr.lhs));
+                resolve_expr(EXPR(e->orexpr.rhs));
                 break;
         case ANDEXPR:
-                resolve_expr(e->andexpr.lhs);
-                resolve_expr(e->andexpr.rhs);
+                resolve_expr(EXPR(e->andexpr.lhs));
+                resolve_expr(EXPR(e->andexpr.rhs));
                 break;
         default:
                 report("No yet implemented: resolve_expr for %s\n",
@@ -142,59 +239,89 @@ resolve_expr(Expr *e)
 }
 
 static void
-resolve_expr_arr(Expr *e)
+resolve_expr_list(NodeList l)
 {
-        while (e) {
-                resolve_expr(e);
-                e = e->next;
-        }
+        for (uint32_t i = 0; i < l.count; i++)
+                resolve_expr(EXPR(LIST_AT(l, i)));
 }
 
-static void resolve_stmt_arr(Stmt *s);
+static void resolve_stmt_list(NodeList l);
+static void resolve_stmt(Stmt *s);
+
+/* Resolve the body of function declaration S and put its captures
+ * after the parameters */
+static void
+resolve_function(Stmt *s)
+{
+        NodeList params = s->funcdecl.params;
+        int count;
+
+        scope_create();
+        closure_create(params.count);
+        for (uint32_t i = 0; i < params.count; i++)
+                declare(EXPR(LIST_AT(params, i))->litexpr.str);
+        resolve_stmt(STMT(s->funcdecl.body));
+
+        count = arrlen(closure->nodes);
+        if (count > UINT16_MAX) {
+                report("Function `%s` captures too many variables: %d\n",
+                       s->funcdecl.name, count);
+                resolve_error();
+        }
+        if (count > 0) {
+                s->funcdecl.params.start = unit_list(params.count + count);
+                for (uint32_t i = 0; i < params.count; i++)
+                        LIST_AT(s->funcdecl.params, i) = LIST_AT(params, i);
+                for (int i = 0; i < count; i++)
+                        LIST_AT(s->funcdecl.params, params.count + i) = closure->nodes[i];
+        }
+        STMT(s->funcdecl.body)->block.captures = count;
+        closure_destroy();
+        scope_destroy();
+}
 
 static void
 resolve_stmt(Stmt *s)
 {
         switch (s->type) {
         case VARDECLSTMT:
-                resolve_expr_arr(s->vardecl.value);
-                if (s->vardecl.value)
-                        declare(s->vardecl.name->str_literal);
-                else
-                        define(s->vardecl.name->str_literal);
+                resolve_expr(EXPR(s->vardecl.value));
+                s->vardecl.slot = declare(s->vardecl.name);
                 break;
         case FUNDECLSTMT:
-                define(s->funcdecl.name->str_literal);
-                env_create();
-                for (vtok *arg = s->funcdecl.params; arg; arg = arg->next) {
-                        declare(arg->str_literal);
-                }
-                resolve_stmt_arr(s->funcdecl.body);
-                env_destroy();
+                s->funcdecl.slot = declare(s->funcdecl.name);
+                resolve_function(s);
                 break;
         case BLOCKSTMT:
-                env_create();
-                resolve_stmt_arr(s->block.body);
-                env_destroy();
+                scope_create();
+                resolve_stmt_list(s->block.body);
+                if (scope->size > UINT16_MAX) {
+                        report("Too many variables in a block: %d\n", scope->size);
+                        resolve_error();
+                }
+                s->block.size = scope_destroy();
                 break;
         case EXPRSTMT:
-                resolve_expr_arr(s->expr.body);
+                resolve_expr(EXPR(s->expr.body));
                 break;
         case ASSERTSTMT:
-                resolve_expr_arr(s->assert.body);
+                resolve_expr(EXPR(s->assert.body));
                 break;
         case IFSTMT:
-                resolve_expr(s->ifstmt.cond);
-                resolve_stmt(s->ifstmt.body);
+                resolve_expr(EXPR(s->ifstmt.cond));
+                resolve_stmt(STMT(s->ifstmt.body));
                 if (s->ifstmt.elsebody)
-                        resolve_stmt(s->ifstmt.elsebody);
+                        resolve_stmt(STMT(s->ifstmt.elsebody));
                 break;
         case WHILESTMT:
-                resolve_expr(s->whilestmt.cond);
-                resolve_stmt(s->whilestmt.body);
+                resolve_expr(EXPR(s->whilestmt.cond));
+                resolve_stmt(STMT(s->whilestmt.body));
                 break;
         case RETSTMT:
-                resolve_expr(s->retstmt.value);
+                resolve_expr(EXPR(s->retstmt.value));
+                /* return f(...) inside a function is a tail call */
+                s->retstmt.tail = closure &&
+                                  EXPR(s->retstmt.value)->type == CALLEXPR;
                 break;
         default:
                 report("No yet implemented: resolve_stmt for %s\n",
@@ -205,50 +332,24 @@ resolve_stmt(Stmt *s)
 }
 
 static void
-resolve_stmt_arr(Stmt *s)
+resolve_stmt_list(NodeList l)
 {
-        while (s) {
-                resolve_stmt(s);
-                s = s->next;
-        }
-}
-
-void
-load_env_data(Env *env)
-{
-        int i = 0;
-        int len = shlenu(env->map);
-        for (; i < len; i++) {
-                if (env->map[i].value.type != TYPE_NONE)
-                        define(env->map[i].key);
-                else
-                        declare(env->map[i].key);
-        }
-
-        if (env->upper) load_env_data(env->upper);
+        for (uint32_t i = 0; i < l.count; i++)
+                resolve_stmt(STMT(LIST_AT(l, i)));
 }
 
 int
 resolve()
 {
-        Env *prev = env_create_e(NULL);
-        load_env_data(prev);
-        if (setjmp(resolve_error_jmp) | setjmp(eval_runtime_error)) {
+        int globals = env_global_count();
+        if (setjmp(resolve_error_jmp)) {
+                while (scope)
+                        scope_destroy();
+                while (closure)
+                        closure_destroy();
+                env_global_truncate(globals);
                 return 1;
         }
-        resolve_stmt_arr(head_stmt);
-        env_destroy_e(prev);
+        resolve_stmt_list(ast_program);
         return 0;
 }
-
-Value
-env_get_l(void *e, char *name)
-{
-        return env_get_o(sidetable_get(e), name);
-}
-
-Value
-env_set_l(void *e, char *name, Value value)
-{
-        return env_set_o(sidetable_get(e), name, value);
-}
@@ -0,0 +1,134 @@
+/* VISPEL interpreter - Size class allocator
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+#include "slab.h"
+
+/* Classes are the powers of two from MIN_SIZE to SLAB_MAX. Each one has
+ * a free list threaded through its free objects, refilled a whole slab
+ * of SLAB_SIZE bytes at a time. Slabs are never returned, as the objects
+ * of a class are usually needed again soon. */
+
+#define SLAB_SIZE (64 * 1024)
+#define MIN_SHIFT 4
+#define MAX_SHIFT 12
+#define CLASSES (MAX_SHIFT - MIN_SHIFT + 1)
+
+typedef struct FreeObj {
+        struct FreeObj *next;
+} FreeObj;
+
+static struct {
+        FreeObj *free;
+        size_t slabs;
+        size_t in_use;
+} classes[CLASSES];
+
+static struct {
+        size_t allocated;
+        size_t in_use;
+} big;
+
+static int
+class_of(size_t size)
+{
+        int c = 0;
+        while (((size_t) 1 << (c + MIN_SHIFT)) < size)
+                ++c;
+        return c;
+}
+
+static void
+new_slab(int c)
+{
+        size_t size = (size_t) 1 << (c + MIN_SHIFT);
+        char *slab = malloc(SLAB_SIZE);
+
+        if (!slab) {
+                report("Out of memory\n");
+                longjmp(eval_runtime_error, 1);
+        }
+        for (char *p = slab + SLAB_SIZE - size; p >= slab; p -= size) {
+                ((FreeObj *) p)->next = classes[c].free;
+                classes[c].free = (FreeObj *) p;
+        }
+        ++classes[c].slabs;
+}
+
+void *
+slab_alloc(size_t size)
+{
+        FreeObj *o;
+        int c;
+
+        if (size == 0) return NULL;
+        if (size > SLAB_MAX) {
+                ++big.allocated;
+                ++big.in_use;
+                return malloc(size);
+        }
+        c = class_of(size);
+        if (!classes[c].free) new_slab(c);
+        o = classes[c].free;
+        classes[c].free = o->next;
+        ++classes[c].in_use;
+        return o;
+}
+
+void
+slab_free(void *p, size_t size)
+{
+        int c;
+
+        if (!p) return;
+        if (size > SLAB_MAX) {
+                --big.in_use;
+                free(p);
+                return;
+        }
+        c = class_of(size);
+        ((FreeObj *) p)->next = classes[c].free;
+        classes[c].free = p;
+        --classes[c].in_use;
+}
+
+void *
+slab_realloc(void *p, size_t old_size, size_t size)
+{
+        void *n;
+
+        if (!p) return slab_alloc(size);
+        if (old_size > SLAB_MAX && size > SLAB_MAX) return realloc(p, size);
+        if (old_size <= SLAB_MAX && size <= SLAB_MAX && class_of(old_size) == class_of(size))
+                return p;
+        n = slab_alloc(size);
+        memcpy(n, p, old_size < size ? old_size : size);
+        slab_free(p, old_size);
+        return n;
+}
+
+void
+slab_print_stats()
+{
+        size_t size, per_slab;
+
+        for (int c = 0; c < CLASSES; c++) {
+                if (!classes[c].slabs) continue;
+                size = (size_t) 1 << (c + MIN_SHIFT);
+                per_slab = SLAB_SIZE / size;
+                fprintf(stderr, "slab: %4zu B: %zu of %zu in use (%.1f%%) in %zu slabs\n",
+                        size, classes[c].in_use, classes[c].slabs * per_slab,
+                        100.0 * classes[c].in_use / (classes[c].slabs * per_slab),
+                        classes[c].slabs);
+        }
+        fprintf(stderr, "slab: > %d B: %zu in use, %zu malloc'd\n",
+                SLAB_MAX, big.in_use, big.allocated);
+}
@@ -0,0 +1,19 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/* Memory for runtime structures that are not collected, as list storage
+ * and core functions. Sizes up to SLAB_MAX are rounded to a power of two
+ * and taken from slabs that only hold objects of that size; bigger ones
+ * go to malloc. The caller gives the size back when freeing. */
+#define SLAB_MAX 4096
+
+void *slab_alloc(size_t size);
+void *slab_realloc(void *p, size_t old_size, size_t size);
+void slab_free(void *p, size_t size);
+
+/* --gc-stats: slabs and objects in use of each size class */
+void slab_print_stats();
+
+#endif // !SLAB_H
@@ -0,0 +1,129 @@
+/* VISPEL interpreter - Immutable strings and the intern table
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "str.h"
+
+/* Open addressing table of interned strings, with linear probing. It
+ * only grows, as interned strings are never freed */
+static Str **table = NULL;
+static uint32_t capacity = 0;
+static uint32_t count = 0;
+
+/* FNV-1a */
+uint32_t
+str_hash(const char *s, size_t len)
+{
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+                h ^= (unsigned char) s[i];
+                h *= 16777619u;
+        }
+        return h;
+}
+
+static void
+grow()
+{
+        Str **old = table;
+        uint32_t old_capacity = capacity;
+        uint32_t i;
+
+        capacity = capacity ? capacity * 2 : 256;
+        table = calloc(capacity, sizeof *table);
+        for (uint32_t j = 0; j < old_capacity; j++) {
+                if (!old[j]) continue;
+                for (i = old[j]->hash & (capacity - 1); table[i]; i = (i + 1) & (capacity - 1))
+                        ;
+                table[i] = old[j];
+        }
+        free(old);
+}
+
+static Str *
+make(Str *s, const char *chars, size_t len, uint32_t hash)
+{
+        s->len = len;
+        s->hash = hash;
+        memcpy(s->chars, chars, len);
+        s->chars[len] = 0;
+        return s;
+}
+
+static Str *
+intern(const char *s, size_t len, uint32_t hash)
+{
+        uint32_t i;
+        Str *str;
+
+        if (2 * (count + 1) > capacity) grow();
+        for (i = hash & (capacity - 1); (str = table[i]); i = (i + 1) & (capacity - 1)) {
+                if (str->hash == hash && str->len == len && !memcmp(str->chars, s, len))
+                        return str;
+        }
+        str = make(malloc(sizeof(Str) + len + 1), s, len, hash);
+        str->interned = 1;
+        table[i] = str;
+        ++count;
+        return str;
+}
+
+Str *
+str_intern(const char *s, size_t len)
+{
+        return intern(s, len, str_hash(s, len));
+}
+
+Str *
+str_intern_str(Str *s)
+{
+        return s->interned ? s : intern(s->chars, s->len, s->hash);
+}
+
+Str *
+str_new(const char *s, size_t len)
+{
+        return make(gc_alloc(GC_STR, sizeof(Str) + len + 1), s, len, str_hash(s, len));
+}
+
+Value
+str_value(const char *s, size_t len)
+{
+        Value v = { .type = TYPE_STR };
+        if (len > STR_SMALL) {
+                v.str = str_new(s, len);
+                return v;
+        }
+        memcpy(v.chars, s, len);
+        v.small = len + 1;
+        return v;
+}
+
+Str *
+str_value_intern(Value v)
+{
+        return v.small ? str_intern(v.chars, v.small - 1) : str_intern_str(v.str);
+}
+
+int
+str_value_equal(Value a, Value b)
+{
+        if (!a.small && !b.small) return str_equal(a.str, b.str);
+        return STR_LEN(a) == STR_LEN(b) && !memcmp(STR_CHARS(a), STR_CHARS(b), STR_LEN(a));
+}
+
+/* Interned strings are equal only if they are the same one */
+int
+str_equal(Str *a, Str *b)
+{
+        if (a == b) return 1;
+        if (a->interned && b->interned) return 0;
+        return a->hash == b->hash && a->len == b->len && !memcmp(a->chars, b->chars, a->len);
+}
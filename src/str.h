@@ -0,0 +1,48 @@
+#ifndef STR_H
+#define STR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+/* Strings are immutable, so length and hash are computed once. Names
+ * and string literals are interned by the lexer: there is a single Str
+ * for each distinct text, and it is never freed. Strings made at run
+ * time are owned by the collector and are only interned on request. */
+typedef struct Str {
+        uint32_t len;
+        uint32_t hash;
+        uint32_t interned;
+        char chars[]; // len chars and a 0
+} Str;
+
+/* Str that holds CHARS, as the names and literals in the AST */
+#define STR_OF(p) ((Str *) ((char *) (p) - offsetof(Str, chars)))
+
+uint32_t str_hash(const char *s, size_t len);
+
+/* The interned string with the LEN chars at S */
+Str *str_intern(const char *s, size_t len);
+/* Interned copy of S, or S if it already is */
+Str *str_intern_str(Str *s);
+
+/* String owned by the collector with the LEN chars at S */
+Str *str_new(const char *s, size_t len);
+
+int str_equal(Str *a, Str *b);
+
+/* Strings of up to STR_SMALL chars made at run time are kept in the
+ * Value itself, so most of them are not allocated. Longer ones and
+ * interned ones are a Str */
+#define STR_SMALL 8
+#define STR_LEN(v) ((v).small ? (v).small - 1 : (v).str->len)
+#define STR_CHARS(v) ((v).small ? (v).chars : (v).str->chars)
+
+/* String value with the LEN chars at S */
+Value str_value(const char *s, size_t len);
+/* Interned copy of string value V */
+Str *str_value_intern(Value v);
+int str_value_equal(Value a, Value b);
+
+#endif // !STR_H
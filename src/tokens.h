@@ -134,18 +134,32 @@ static const char *TOKEN_REPR[] = {
         [UNKNOWN] = "UNKNOWN",
 };
 
-typedef struct vtok {
-        const char *lexeme;
-        vtoktype token;
-        union {
-                int num_literal;
-                char *str_literal;
-        };
-        int line;
-        intptr_t offset;
-        /* Linked list stuff */
-        struct vtok *next;
-} vtok;
+/* Tokens of the last lexed source, in arrays indexed by TokRef. The
+ * parser mostly reads kinds, so they are a byte each and kept apart from
+ * literals and positions. A position is the offset of the token in the
+ * source; its line and column are only found for error messages. Names
+ * and string literals are interned, as they outlive the source */
+typedef uint32_t TokRef; // 0 is not a token
+
+typedef union TokLiteral {
+        int num;
+        char *str;
+} TokLiteral;
+
+typedef struct Tokens {
+        uint8_t *kind; // vtoktype
+        TokLiteral *literal;
+        uint32_t *pos;
+        uint32_t *lines; // offset where each line starts
+        int first_line;
+        uint32_t count;
+} Tokens;
+
+extern Tokens tokens;
+
+#define TOK_KIND(t) ((vtoktype) tokens.kind[t])
+#define TOK_NUM(t) (tokens.literal[t].num)
+#define TOK_STR(t) (tokens.literal[t].str)
 
 typedef enum Exprtype {
         ASSIGNEXPR,
@@ -156,6 +170,24 @@ typedef enum Exprtype {
         VAREXPR,
         ANDEXPR,
         OREXPR,
+        /* BINEXPR specialized for number operands, see eval.c */
+        BINEXPR_ADD_NUM,
+        BINEXPR_SUB_NUM,
+        BINEXPR_MUL_NUM,
+        BINEXPR_DIV_NUM,
+        BINEXPR_BAND_NUM,
+        BINEXPR_BOR_NUM,
+        BINEXPR_BXOR_NUM,
+        BINEXPR_EQ_NUM,
+        BINEXPR_NE_NUM,
+        BINEXPR_GT_NUM,
+        BINEXPR_GE_NUM,
+        BINEXPR_LT_NUM,
+        BINEXPR_LE_NUM,
+        /* Fused nodes, see optimizer.c */
+        INCEXPR,
+        CMPEXPR,
+        GETEXPR,
 } Exprtype;
 
 static const char *EXPR_REPR[] = {
@@ -167,23 +199,51 @@ static const char *EXPR_REPR[] = {
         [VAREXPR] = "VAREXPR",
         [ANDEXPR] = "ANDEXPR",
         [OREXPR] = "OREXPR",
+        [BINEXPR_ADD_NUM] = "BINEXPR_ADD_NUM",
+        [BINEXPR_SUB_NUM] = "BINEXPR_SUB_NUM",
+        [BINEXPR_MUL_NUM] = "BINEXPR_MUL_NUM",
+        [BINEXPR_DIV_NUM] = "BINEXPR_DIV_NUM",
+        [BINEXPR_BAND_NUM] = "BINEXPR_BAND_NUM",
+        [BINEXPR_BOR_NUM] = "BINEXPR_BOR_NUM",
+        [BINEXPR_BXOR_NUM] = "BINEXPR_BXOR_NUM",
+        [BINEXPR_EQ_NUM] = "BINEXPR_EQ_NUM",
+        [BINEXPR_NE_NUM] = "BINEXPR_NE_NUM",
+        [BINEXPR_GT_NUM] = "BINEXPR_GT_NUM",
+        [BINEXPR_GE_NUM] = "BINEXPR_GE_NUM",
+        [BINEXPR_LT_NUM] = "BINEXPR_LT_NUM",
+        [BINEXPR_LE_NUM] = "BINEXPR_LE_NUM",
+        [INCEXPR] = "INCEXPR",
+        [CMPEXPR] = "CMPEXPR",
+        [GETEXPR] = "GETEXPR",
 };
 
+/* Nodes of the AST are stored in a flat array (see unit.c) and refer to
+ * each other by index. 0 is not a node, so it means no node. Lists of
+ * nodes (arguments, statements of a block, parameters) are COUNT indices
+ * in ast_lists from START. */
+typedef uint32_t NodeRef;
+typedef struct NodeList {
+        uint32_t start;
+        uint32_t count;
+} NodeList;
+
 // clang-format off
 typedef struct Expr {
         union {
-                struct { struct Expr *value; vtok *name; } assignexpr;
-                struct { struct Expr *rhs; struct Expr *lhs; vtok *op; } binexpr;
-                struct { struct Expr *rhs; struct Expr *lhs; } andexpr;
-                struct { struct Expr *rhs; struct Expr *lhs; } orexpr;
-                struct { struct Expr *rhs; vtok *op; } unexpr;
-                struct { struct Expr *name; int count; struct Expr *args; } callexpr;
-                struct { struct Expr *value; vtok *name; } varexpr;
-                struct { vtok *value; } litexpr;
+                struct { char *name; NodeRef value; int depth; int slot; } assignexpr;
+                struct { NodeRef lhs; NodeRef rhs; uint16_t op; uint16_t generic; } binexpr;
+                struct { NodeRef lhs; NodeRef rhs; } andexpr;
+                struct { NodeRef lhs; NodeRef rhs; } orexpr;
+                struct { NodeRef rhs; uint16_t op; } unexpr;
+                struct { NodeRef name; NodeList args; } callexpr;
+                struct { char *name; NodeRef value; } varexpr;
+                /* Literals keep the value of their token */
+                struct { union { int num; char *str; }; vtoktype token; int depth; int slot; } litexpr;
+                /* Fused nodes keep the layout of the node they replace */
+                struct { char *name; NodeRef value; int depth; int slot; int k; } incexpr;
+                struct { NodeRef lhs; NodeRef rhs; uint16_t op; uint16_t generic; int depth; int slot; int k; } cmpexpr;
         };
         Exprtype type;
-        /* Linked list stuff */
-        struct Expr *next;
 } Expr;
 // clang-format on
 
@@ -212,32 +272,67 @@ static const char *STMT_REPR[] = {
 // clang-format off
 typedef struct Stmt {
         union {
-                struct { vtok *name; Expr *value; } vardecl;
-                struct { struct Stmt *body; } block;
-                struct { Expr *body; } expr;
-                struct { Expr *cond; struct Stmt *body; struct Stmt *elsebody; } ifstmt;
-                struct { Expr *cond; struct Stmt *body; } whilestmt;
-                struct { Expr *body; } assert;
-                struct { Expr *value; } retstmt;
-                struct { vtok *name; vtok *params; int arity; struct Stmt *body; } funcdecl;
+                struct { char *name; NodeRef value; int slot; } vardecl;
+                /* The body of a function keeps how many variables it captures */
+                struct { struct Jit *jit; NodeList body; uint16_t size; uint16_t captures; int calls; } block;
+                struct { NodeRef body; } expr;
+                struct { NodeRef cond; NodeRef body; NodeRef elsebody; } ifstmt;
+                struct { NodeRef cond; NodeRef body; int iters; } whilestmt;
+                struct { NodeRef body; } assert;
+                struct { NodeRef value; int tail; } retstmt;
+                /* Parameters are identifier literals. The list goes on with
+                 * the captures of the function (see func_captures()) */
+                struct { char *name; NodeList params; NodeRef body; int slot; } funcdecl;
         };
         Stmttype type;
-        struct Stmt *next;
 } Stmt;
 // clang-format on
 
-extern vtok *head_token;
-extern Stmt *head_stmt;
+typedef union Node {
+        Expr expr;
+        Stmt stmt;
+} Node;
+
+extern Node *ast_nodes;
+extern NodeRef *ast_lists;
+
+#define EXPR(ref) (&ast_nodes[ref].expr)
+#define STMT(ref) (&ast_nodes[ref].stmt)
+#define NODE_REF(p) ((NodeRef) ((Node *) (p) - ast_nodes))
+/* I-th node of list L */
+#define LIST_AT(l, i) (ast_lists[(l).start + (i)])
+
+/* Variables captured by function declaration S, as identifier literals
+ * resolved in the scope where it is declared (see resolver.c) */
+static inline NodeList
+func_captures(Stmt *s)
+{
+        return (NodeList) {
+                .start = s->funcdecl.params.start + s->funcdecl.params.count,
+                .count = STMT(s->funcdecl.body)->block.captures,
+        };
+}
+
+/* Top level statements of the last parsed unit */
+extern NodeList ast_program;
 
-/* ./lexer.c */
+/* ./lexer.c: Lex SOURCE, that ends with a 0, into tokens. The caller
+ * starts the unit its AST goes to. The lexer reads sources in blocks, so
+ * the LEX_PAD bytes after the 0 have to be readable */
+#define LEX_PAD 64
 void lex_analize(char *source);
+/* Line and column of token T, counted from 1 */
+void tok_position(TokRef t, int *line, int *column);
+/* Lex the whole file FILENAME at once, in a new unit. Return its size,
+ * or -1 if it can not be read */
+ssize_t lex_file(const char *filename);
+/* --lex-bench: print the lexing throughput of FILENAME */
+int lex_bench(const char *filename);
 void print_tokens();
-void free_tokens();
-void print_literal(vtok *tok);
+void print_literal(TokRef t);
 
 /* ./parser.c */
 void tok_parse();
 void print_ast();
-void free_stmt_head();
 
 #endif
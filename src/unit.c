@@ -0,0 +1,291 @@
+/* VISPEL interpreter - Arenas for the code of each source unit
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+#include "unit.h"
+
+#include "stb_ds.h"
+
+/* Memory is taken from chunks of CHUNK_SIZE bytes aligned to its size,
+ * by moving a pointer. Bigger requests get a chunk of their own that is a
+ * multiple of it. Every CHUNK_SIZE piece is in chunk_map, so finding the
+ * unit of an address (as the collector does for each word of the stack)
+ * is a single lookup.
+ *
+ * AST nodes and node lists are not in chunks but in ast_nodes and
+ * ast_lists, so they can be referenced by a 32 bit index. Both arrays
+ * are reserved at once, so nodes never move, and pages are only backed
+ * by memory once they are written. Units take nodes in order, so each one
+ * owns a range of indices, that is given back to the system when the
+ * unit is freed. Indices are not reused. */
+
+#define CHUNK_SIZE (64 * 1024)
+#define ALIGN 16
+#define NODES_MAX (1u << 27)
+#define LISTS_MAX (1u << 28)
+
+typedef struct Chunk {
+        char *start;
+        size_t size;
+} Chunk;
+
+typedef struct Cleanup {
+        void (*fn)(void *);
+        void *arg;
+        struct Cleanup *next;
+} Cleanup;
+
+typedef struct Unit {
+        char *ptr; // free space of the last chunk
+        char *end;
+        Chunk *chunks;
+        Cleanup *cleanups;
+        uint32_t node_start; // nodes in [node_start, node_end)
+        uint32_t node_end;
+        uint32_t list_start;
+        uint32_t list_end;
+        int marked;
+} Unit;
+
+/* In the order they were created, that is, by node_start */
+static Unit **units = NULL;
+static Unit *current_unit = NULL;
+
+Node *ast_nodes = NULL;
+NodeRef *ast_lists = NULL;
+static uint32_t node_top = 1; // 0 is not a node
+static uint32_t list_top = 0;
+
+static struct {
+        void *key;
+        Unit *value;
+} *chunk_map = NULL;
+
+static uintptr_t units_lo = UINTPTR_MAX;
+static uintptr_t units_hi = 0;
+
+/* Last chunk found by find_unit() */
+static void *last_piece = NULL;
+static Unit *last_unit = NULL;
+
+/* Unit that owns node I */
+static Unit *
+find_node_unit(uint32_t i)
+{
+        int lo = 0;
+        int hi = arrlen(units) - 1;
+        int mid;
+
+        while (lo <= hi) {
+                mid = (lo + hi) / 2;
+                if (i < units[mid]->node_start)
+                        hi = mid - 1;
+                else if (i >= units[mid]->node_end)
+                        lo = mid + 1;
+                else
+                        return units[mid];
+        }
+        return NULL;
+}
+
+static Unit *
+find_unit(void *p)
+{
+        uintptr_t a = (uintptr_t) p;
+        void *piece = (void *) (a & ~(uintptr_t) (CHUNK_SIZE - 1));
+        ptrdiff_t i;
+
+        if (a >= (uintptr_t) ast_nodes && a < (uintptr_t) (ast_nodes + NODES_MAX))
+                return find_node_unit((Node *) p - ast_nodes);
+        if (a < units_lo || a >= units_hi) return NULL;
+        if (piece == last_piece) return last_unit;
+        if ((i = hmgeti(chunk_map, piece)) < 0) return NULL;
+        last_piece = piece;
+        last_unit = chunk_map[i].value;
+        return last_unit;
+}
+
+static char *
+new_chunk(Unit *u, size_t size)
+{
+        Chunk c;
+
+        c.size = (size + CHUNK_SIZE - 1) & ~(size_t) (CHUNK_SIZE - 1);
+        if (posix_memalign((void **) &c.start, CHUNK_SIZE, c.size)) {
+                report("Out of memory\n");
+                exit(1);
+        }
+        memset(c.start, 0, c.size);
+        arrput(u->chunks, c);
+        for (size_t off = 0; off < c.size; off += CHUNK_SIZE)
+                hmput(chunk_map, c.start + off, u);
+
+        if ((uintptr_t) c.start < units_lo) units_lo = (uintptr_t) c.start;
+        if ((uintptr_t) c.start + c.size > units_hi) units_hi = (uintptr_t) c.start + c.size;
+        return c.start;
+}
+
+static void *
+reserve(size_t size)
+{
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+                report("Can not reserve memory for the AST\n");
+                exit(1);
+        }
+        return p;
+}
+
+void
+unit_begin()
+{
+        Unit *u = calloc(1, sizeof(Unit));
+
+        if (!ast_nodes) {
+                ast_nodes = reserve(sizeof(Node) * NODES_MAX);
+                ast_lists = reserve(sizeof(NodeRef) * LISTS_MAX);
+        }
+        u->node_start = u->node_end = node_top;
+        u->list_start = u->list_end = list_top;
+        arrput(units, u);
+        current_unit = u;
+}
+
+NodeRef
+unit_node()
+{
+        if (!current_unit) unit_begin();
+        if (node_top == NODES_MAX) {
+                report("Out of memory for AST nodes\n");
+                exit(1);
+        }
+        current_unit->node_end = node_top + 1;
+        return node_top++;
+}
+
+uint32_t
+unit_list(int count)
+{
+        uint32_t start = list_top;
+
+        if (!current_unit) unit_begin();
+        if (count > LISTS_MAX - list_top) {
+                report("Out of memory for AST lists\n");
+                exit(1);
+        }
+        list_top += count;
+        current_unit->list_end = list_top;
+        return start;
+}
+
+void *
+unit_alloc(size_t size)
+{
+        Unit *u = current_unit;
+        void *p;
+
+        if (!u) {
+                unit_begin();
+                u = current_unit;
+        }
+        size = (size + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+        if (size > CHUNK_SIZE / 4) return new_chunk(u, size);
+        if (u->ptr + size > u->end) {
+                u->ptr = new_chunk(u, CHUNK_SIZE);
+                u->end = u->ptr + CHUNK_SIZE;
+        }
+        p = u->ptr;
+        u->ptr += size;
+        return p;
+}
+
+void
+unit_on_free(void *p, void (*fn)(void *), void *arg)
+{
+        Unit *u = find_unit(p);
+        Cleanup *c;
+
+        if (!u) return;
+        c = malloc(sizeof *c);
+        c->fn = fn;
+        c->arg = arg;
+        c->next = u->cleanups;
+        u->cleanups = c;
+}
+
+int
+unit_mark(void *p)
+{
+        Unit *u = find_unit(p);
+        if (!u) return 0;
+        u->marked = 1;
+        return 1;
+}
+
+/* Give back the pages that are only used by [START, END) */
+static void
+release(void *start, void *end)
+{
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t a = ((uintptr_t) start + page - 1) & ~(page - 1);
+        uintptr_t b = (uintptr_t) end & ~(page - 1);
+        if (a < b) madvise((void *) a, b - a, MADV_DONTNEED);
+}
+
+static void
+unit_free(Unit *u)
+{
+        Cleanup *c;
+
+        while ((c = u->cleanups)) {
+                c->fn(c->arg);
+                u->cleanups = c->next;
+                free(c);
+        }
+        for (int i = 0; i < arrlen(u->chunks); i++) {
+                for (size_t off = 0; off < u->chunks[i].size; off += CHUNK_SIZE)
+                        hmdel(chunk_map, u->chunks[i].start + off);
+                free(u->chunks[i].start);
+        }
+        arrfree(u->chunks);
+        release(ast_nodes + u->node_start, ast_nodes + u->node_end);
+        release(ast_lists + u->list_start, ast_lists + u->list_end);
+        free(u);
+        last_piece = NULL;
+}
+
+void
+unit_sweep()
+{
+        int n = 0;
+
+        for (int i = 0; i < arrlen(units); i++) {
+                if (units[i]->marked || units[i] == current_unit) {
+                        units[i]->marked = 0;
+                        units[n++] = units[i];
+                } else
+                        unit_free(units[i]);
+        }
+        arrsetlen(units, n);
+}
+
+void
+unit_free_all()
+{
+        for (int i = 0; i < arrlen(units); i++)
+                unit_free(units[i]);
+        arrfree(units);
+        current_unit = NULL;
+        hmfree(chunk_map);
+}
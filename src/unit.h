@@ -0,0 +1,35 @@
+#ifndef UNIT_H
+#define UNIT_H
+
+#include <stddef.h>
+
+#include "tokens.h"
+
+/* The AST and everything derived from it (closure trees, VM protos)
+ * are allocated in the unit of the source it comes from: a loaded file
+ * or a chunk read by the REPL. A unit is freed at once when
+ * no value that points into it is reachable. */
+
+/* Start a new unit. Allocations go to it until the next one is started */
+void unit_begin();
+
+/* Allocate SIZE zeroed bytes in the current unit */
+void *unit_alloc(size_t size);
+
+/* Index of a new zeroed node, and of the first of COUNT new list entries */
+NodeRef unit_node();
+uint32_t unit_list(int count);
+
+/* Call FN(ARG) when the unit that holds P is freed, to release memory
+ * that is not in the unit, as stb_ds arrays or native code */
+void unit_on_free(void *p, void (*fn)(void *), void *arg);
+
+/* Called by the collector: keep alive the unit that holds P. Return 0 if
+ * P does not point into a unit */
+int unit_mark(void *p);
+
+/* Free units that were not marked, except the current one */
+void unit_sweep();
+void unit_free_all();
+
+#endif // !UNIT_H
@@ -0,0 +1,379 @@
+/* VISPEL interpreter - Bytecode virtual machine
+ *
+ * Author: Hugo Coto Florez
+ * Repo: github.com/hugocotoflorez/vispel
+ *
+ * */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+#include "gc.h"
+#include "interpreter.h"
+#include "tokens.h"
+#include "vm.h"
+
+#define STACK_MAX (1 << 16)
+#define FRAMES_MAX (1 << 14)
+
+typedef struct Frame {
+        Proto *proto;
+        uint8_t *ip;     // return address
+        Value *base;     // callee slot in the caller stack
+        Env *env;        // caller env
+} Frame;
+
+static Value stack[STACK_MAX];
+static Frame frames[FRAMES_MAX];
+
+/* Used part of the stacks, saved before anything that can allocate */
+static Value *stack_top = stack;
+static Frame *frame_top = frames;
+#define SAVE_TOP() (stack_top = sp, frame_top = fp)
+
+static void
+mark_roots()
+{
+        gc_mark_range(stack, stack_top);
+        gc_mark_range(frames, frame_top);
+}
+
+static __attribute__((constructor)) void
+__init__()
+{
+        gc_add_roots(mark_roots);
+}
+
+static inline _Noreturn void
+runtime_error()
+{
+        longjmp(eval_runtime_error, 1);
+}
+
+#define READ16() (ip += 2, ip[-2] | (ip[-1] << 8))
+#define READ32() (ip += 4, read32(ip - 4))
+
+/* Jump offsets are read on every loop iteration: a single load */
+static inline int
+read32(uint8_t *ip)
+{
+        int32_t n;
+        memcpy(&n, ip, sizeof n);
+        return n;
+}
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+#define TOP() (sp[-1])
+
+/* Int-int operations are done inline, anything else (including errors)
+ * is handled by the shared eval_binop() */
+#define BINOP(OP, TOK)                                                    \
+        do {                                                              \
+                Value rhs = POP();                                        \
+                if (TOP().type == TYPE_NUM && rhs.type == TYPE_NUM)       \
+                        TOP().num = TOP().num OP rhs.num;                 \
+                else                                                      \
+                        TOP() = eval_binop(TOK, TOP(), rhs);              \
+        } while (0)
+
+/* Comparisons leave TYPE_NUM too, so the same fast path is valid */
+#define CMPOP BINOP
+
+static Value
+run(Proto *entry)
+{
+        static void *dispatch[] = {
+                [OP_CONST] = &&op_const,
+                [OP_GET] = &&op_get,
+                [OP_SET] = &&op_set,
+                [OP_GET_GLOBAL] = &&op_get_global,
+                [OP_SET_GLOBAL] = &&op_set_global,
+                [OP_GET_CELL] = &&op_get_cell,
+                [OP_SET_CELL] = &&op_set_cell,
+                [OP_DEFINE] = &&op_define,
+                [OP_POP] = &&op_pop,
+                [OP_ADD] = &&op_add,
+                [OP_SUB] = &&op_sub,
+                [OP_MUL] = &&op_mul,
+                [OP_DIV] = &&op_div,
+                [OP_BAND] = &&op_band,
+                [OP_BOR] = &&op_bor,
+                [OP_BXOR] = &&op_bxor,
+                [OP_SHL] = &&op_shl,
+                [OP_SHR] = &&op_shr,
+                [OP_EQ] = &&op_eq,
+                [OP_NE] = &&op_ne,
+                [OP_GT] = &&op_gt,
+                [OP_GE] = &&op_ge,
+                [OP_LT] = &&op_lt,
+                [OP_LE] = &&op_le,
+                [OP_NOT] = &&op_not,
+                [OP_NEG] = &&op_neg,
+                [OP_BNOT] = &&op_bnot,
+                [OP_JUMP] = &&op_jump,
+                [OP_JUMP_FALSE] = &&op_jump_false,
+                [OP_JUMP_TRUE_OR_POP] = &&op_jump_true_or_pop,
+                [OP_LOOP] = &&op_loop,
+                [OP_CALL] = &&op_call,
+                [OP_RETURN] = &&op_return,
+                [OP_FUNC] = &&op_func,
+                [OP_ENV_PUSH] = &&op_env_push,
+                [OP_ENV_POP] = &&op_env_pop,
+                [OP_ASSERT] = &&op_assert,
+                [OP_HALT] = &&op_halt,
+                [OP_WIDE] = &&op_wide,
+        };
+
+        Proto *proto = entry;
+        uint8_t *ip = entry->code;
+        Value *k = entry->k;
+        Value *sp = stack;
+        Frame *fp = frames;
+        Proto *p;
+        int a, b;
+        Value v;
+
+#define DISPATCH() goto *dispatch[*ip++]
+
+        DISPATCH();
+
+op_const:
+        a = READ16();
+op_const_a:
+        PUSH(k[a]);
+        DISPATCH();
+op_get:
+        a = READ16();
+        b = READ16();
+        PUSH(*env_ref(a, b));
+        DISPATCH();
+op_set:
+        a = READ16();
+        b = READ16();
+        *env_ref(a, b) = TOP();
+        DISPATCH();
+op_get_global:
+        a = READ16();
+op_get_global_a:
+        PUSH(global_env->slots[a]);
+        DISPATCH();
+op_set_global:
+        a = READ16();
+op_set_global_a:
+        global_env->slots[a] = TOP();
+        DISPATCH();
+op_get_cell:
+        a = READ16();
+        b = READ16();
+        SAVE_TOP(); // the variable is put in a cell on first use
+        PUSH(env_cell(env_ref(a, b))->value);
+        DISPATCH();
+op_set_cell:
+        a = READ16();
+        b = READ16();
+        SAVE_TOP();
+        env_cell(env_ref(a, b))->value = TOP();
+        DISPATCH();
+op_define:
+        a = READ16();
+op_define_a:
+        *env_decl_ref(a) = POP();
+        DISPATCH();
+op_pop:
+        --sp;
+        DISPATCH();
+op_add:
+        BINOP(+, PLUS);
+        DISPATCH();
+op_sub:
+        BINOP(-, MINUS);
+        DISPATCH();
+op_mul:
+        BINOP(*, STAR);
+        DISPATCH();
+op_div:
+        BINOP(/, SLASH);
+        DISPATCH();
+op_band:
+        BINOP(&, BITWISE_AND);
+        DISPATCH();
+op_bor:
+        BINOP(|, BITWISE_OR);
+        DISPATCH();
+op_bxor:
+        BINOP(^, BITWISE_XOR);
+        DISPATCH();
+op_shl:
+        BINOP(<<, SHIFT_LEFT);
+        DISPATCH();
+op_shr:
+        BINOP(>>, SHIFT_RIGHT);
+        DISPATCH();
+op_eq:
+        CMPOP(==, EQUAL_EQUAL);
+        DISPATCH();
+op_ne:
+        CMPOP(!=, BANG_EQUAL);
+        DISPATCH();
+op_gt:
+        CMPOP(>, GREATER);
+        DISPATCH();
+op_ge:
+        CMPOP(>=, GREATER_EQUAL);
+        DISPATCH();
+op_lt:
+        CMPOP(<, LESS);
+        DISPATCH();
+op_le:
+        CMPOP(<=, LESS_EQUAL);
+        DISPATCH();
+op_not:
+        TOP() = eval_unop(BANG, TOP());
+        DISPATCH();
+op_neg:
+        TOP() = eval_unop(MINUS, TOP());
+        DISPATCH();
+op_bnot:
+        TOP() = eval_unop(BITWISE_NOT, TOP());
+        DISPATCH();
+op_jump:
+        a = READ32();
+        ip += a;
+        DISPATCH();
+op_jump_false:
+        a = READ32();
+        if (!is_true(POP())) ip += a;
+        DISPATCH();
+op_jump_true_or_pop:
+        a = READ32();
+        if (is_true(TOP()))
+                ip += a;
+        else
+                --sp;
+        DISPATCH();
+op_loop:
+        a = READ32();
+        ip -= a;
+        DISPATCH();
+
+op_call:
+        a = READ16();
+op_call_a:
+        v = sp[-a - 1];
+        switch (v.type) {
+        case TYPE_CALLABLE:
+        case TYPE_CORE_CALL:
+                break;
+        default:
+                report("Calling a non callable expression\n");
+                runtime_error();
+        }
+        check_arity(v, a);
+        SAVE_TOP();
+
+        if (v.type == TYPE_CORE_CALL) {
+                v = v.fn->ifunc(sp - a, a);
+                sp -= a + 1;
+                PUSH(v);
+                DISPATCH();
+        }
+
+        if (fp - frames >= FRAMES_MAX - 1 || sp - stack >= STACK_MAX / 2) {
+                report("Stack overflow calling `%s`\n", v.fn->name);
+                runtime_error();
+        }
+        *fp++ = (Frame) {
+                .proto = proto,
+                .ip = ip,
+                .base = sp - a - 1,
+                .env = env_push_call(v.fn, sp - a, a),
+        };
+        sp -= a + 1;
+        proto = v.fn->proto;
+        ip = proto->code;
+        k = proto->k;
+        DISPATCH();
+
+op_return:
+        v = POP();
+        if (fp == frames) return v;
+        --fp;
+        env_destroy_e(fp->env);
+        sp = fp->base;
+        proto = fp->proto;
+        ip = fp->ip;
+        k = proto->k;
+        PUSH(v);
+        DISPATCH();
+
+op_func:
+        a = READ16();
+op_func_a:
+        p = k[a].addr;
+        SAVE_TOP();
+        v = new_closure(p->arity, p->name, p->captures);
+        v.fn->proto = p;
+        PUSH(v);
+        DISPATCH();
+
+op_env_push:
+        SAVE_TOP(); // falls back to the collector if the stack is full
+        env_push(READ16());
+        DISPATCH();
+op_env_pop:
+        env_destroy();
+        DISPATCH();
+
+op_assert:
+        if (!is_true(POP())) {
+                report("Assert failed\n");
+                runtime_error();
+        }
+        DISPATCH();
+
+op_halt:
+        return POP();
+
+/* Same instructions, entered with the operand already read in `a` */
+op_wide:
+        b = *ip++;
+        a = READ32();
+        switch (b) {
+        case OP_CONST:
+                goto op_const_a;
+        case OP_GET_GLOBAL:
+                goto op_get_global_a;
+        case OP_SET_GLOBAL:
+                goto op_set_global_a;
+        case OP_DEFINE:
+                goto op_define_a;
+        case OP_CALL:
+                goto op_call_a;
+        case OP_FUNC:
+                goto op_func_a;
+        default:
+                report("Invalid wide instruction %s\n", OPCODE_REPR[b]);
+                runtime_error();
+        }
+
+#undef DISPATCH
+}
+
+void
+vm_eval()
+{
+        Env *env = get_current_env();
+        Value v;
+
+        if (setjmp(eval_runtime_error)) {
+                env_unwind(env);
+                return;
+        }
+        v = run(compile(ast_program));
+        env_unwind(env);
+        print_val(v);
+        printf("\n");
+}
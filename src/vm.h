@@ -0,0 +1,114 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+
+#include "interpreter.h"
+#include "tokens.h"
+
+/* Operands are stored inline after the opcode as 16 bit little endian
+ * values, but jump offsets (A), that are 32 bit in host order. K is the
+ * constant pool index, D the resolver depth (number of envs to go up) and
+ * S the slot of the variable in that env. OP_WIDE before an instruction
+ * with a single K, S or C operand makes it 32 bit (host order too), for
+ * programs with more than 65535 constants or globals. */
+typedef enum Opcode {
+        OP_CONST,        // K       push K
+        OP_GET,          // D S     push variable
+        OP_SET,          // D S     set variable to top (keeps it)
+        OP_GET_GLOBAL,   // S       same as OP_GET for the global env
+        OP_SET_GLOBAL,   // S       same as OP_SET for the global env
+        OP_GET_CELL,     // D S     same as OP_GET for a variable in a cell
+        OP_SET_CELL,     // D S     same as OP_SET for a variable in a cell
+        OP_DEFINE,       // S       pop and store in current env
+        OP_POP,          //         discard top
+        OP_ADD,          //         binary operators: pop rhs, lhs
+        OP_SUB,          //
+        OP_MUL,          //
+        OP_DIV,          //
+        OP_BAND,         //
+        OP_BOR,          //
+        OP_BXOR,         //
+        OP_SHL,          //
+        OP_SHR,          //
+        OP_EQ,           //
+        OP_NE,           //
+        OP_GT,           //
+        OP_GE,           //
+        OP_LT,           //
+        OP_LE,           //
+        OP_NOT,          //         unary operators: pop rhs
+        OP_NEG,          //
+        OP_BNOT,         //
+        OP_JUMP,         // A       ip += A
+        OP_JUMP_FALSE,   // A       pop, ip += A if false
+        OP_JUMP_TRUE_OR_POP, // A   ip += A if top is true, else pop
+        OP_LOOP,         // A       ip -= A
+        OP_CALL,         // C       call top-C-1 with C arguments
+        OP_RETURN,       //         return top to caller
+        OP_FUNC,         // K       push callable for prototype K
+        OP_ENV_PUSH,     // S       enter block that needs S slots
+        OP_ENV_POP,      //         exit block
+        OP_ASSERT,       //         pop, fail if false
+        OP_HALT,         //         end of program, top is the result
+        OP_WIDE,         // op X    op with a 32 bit operand X
+} Opcode;
+
+static const char *OPCODE_REPR[] = {
+        [OP_CONST] = "CONST",
+        [OP_GET] = "GET",
+        [OP_SET] = "SET",
+        [OP_GET_GLOBAL] = "GET_GLOBAL",
+        [OP_SET_GLOBAL] = "SET_GLOBAL",
+        [OP_GET_CELL] = "GET_CELL",
+        [OP_SET_CELL] = "SET_CELL",
+        [OP_DEFINE] = "DEFINE",
+        [OP_POP] = "POP",
+        [OP_ADD] = "ADD",
+        [OP_SUB] = "SUB",
+        [OP_MUL] = "MUL",
+        [OP_DIV] = "DIV",
+        [OP_BAND] = "BAND",
+        [OP_BOR] = "BOR",
+        [OP_BXOR] = "BXOR",
+        [OP_SHL] = "SHL",
+        [OP_SHR] = "SHR",
+        [OP_EQ] = "EQ",
+        [OP_NE] = "NE",
+        [OP_GT] = "GT",
+        [OP_GE] = "GE",
+        [OP_LT] = "LT",
+        [OP_LE] = "LE",
+        [OP_NOT] = "NOT",
+        [OP_NEG] = "NEG",
+        [OP_BNOT] = "BNOT",
+        [OP_JUMP] = "JUMP",
+        [OP_JUMP_FALSE] = "JUMP_FALSE",
+        [OP_JUMP_TRUE_OR_POP] = "JUMP_TRUE_OR_POP",
+        [OP_LOOP] = "LOOP",
+        [OP_CALL] = "CALL",
+        [OP_RETURN] = "RETURN",
+        [OP_FUNC] = "FUNC",
+        [OP_ENV_PUSH] = "ENV_PUSH",
+        [OP_ENV_POP] = "ENV_POP",
+        [OP_ASSERT] = "ASSERT",
+        [OP_HALT] = "HALT",
+        [OP_WIDE] = "WIDE",
+};
+
+/* Compiled function (or top level program). Code and constants are
+ * stb_ds dynamic arrays. */
+typedef struct Proto {
+        uint8_t *code;
+        Value *k;
+        char *name;
+        int arity;
+        NodeList captures; // see func_captures()
+        struct ConstSlot *consts; // see add_const(), only while compiling
+} Proto;
+
+/* ./compiler.c */
+Proto *compile(NodeList program);
+void print_proto(Proto *p);
+
+#endif // !VM_H